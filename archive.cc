@@ -0,0 +1,462 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <algorithm>
+
+#include "spdlog/spdlog.h"
+
+#include "util.h"
+#include "archive.h"
+
+namespace archive {
+
+static bool write_all(int fd, const struct iovec *iov, int n, size_t len)
+{
+  struct iovec v[3];
+  std::copy(iov, iov + n, v);
+
+  size_t done = 0;
+  int i = 0;
+
+  while (done < len) {
+    ssize_t r = writev(fd, v + i, n - i);
+    if (r < 0) {
+      return false;
+    }
+
+    done += r;
+
+    while (i < n && (size_t) r >= v[i].iov_len) {
+      r -= v[i].iov_len;
+      i++;
+    }
+
+    if (i < n) {
+      v[i].iov_base = (char *) v[i].iov_base + r;
+      v[i].iov_len -= r;
+    }
+  }
+
+  return true;
+}
+
+writer::writer(writer &&o)
+  : base(std::move(o.base)), max_size(o.max_size),
+    segment(o.segment), segment_path(std::move(o.segment_path)),
+    fd(o.fd), offset(o.offset),
+    dictionary(std::move(o.dictionary)),
+    dictionary_offset(o.dictionary_offset)
+{
+  o.fd = -1;
+}
+
+writer::~writer()
+{
+  close();
+}
+
+void writer::close()
+{
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+bool writer::next_segment()
+{
+  close();
+
+  util::make_path(base);
+
+  struct stat s;
+
+  do {
+    segment_path = fmt::format("{}/{}.warc", base, segment++);
+  } while (stat(segment_path.c_str(), &s) == 0);
+
+  fd = open(segment_path.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_APPEND, 0664);
+  if (fd < 0) {
+    spdlog::warn("error opening segment {}", segment_path);
+    return false;
+  }
+
+  offset = 0;
+
+  if (!dictionary.empty()) {
+    return write_dictionary();
+  }
+
+  return true;
+}
+
+bool writer::write_dictionary()
+{
+  auto header = fmt::format(
+      "WARC/1.0\r\n"
+      "WARC-Type: resource\r\n"
+      "WARC-Target-URI: urn:x-dictionary\r\n"
+      "Content-Type: application/x-deflate-dictionary\r\n"
+      "Content-Length: {}\r\n"
+      "\r\n",
+      dictionary.size());
+
+  dictionary_offset = offset;
+
+  return write_record(header,
+      (const uint8_t *) dictionary.data(), dictionary.size()).has_value();
+}
+
+body::body(const std::string &dictionary, buffer_pool *pool)
+  : zs(new z_stream()), pool(pool)
+{
+  // A smaller than default memLevel, this is per connection.
+  if (deflateInit2(zs.get(), Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+        15, 6, Z_DEFAULT_STRATEGY) != Z_OK) {
+    delete zs.release();
+    ok = false;
+    return;
+  }
+
+  if (!dictionary.empty()) {
+    with_dictionary = deflateSetDictionary(zs.get(),
+        (const Bytef *) dictionary.data(), dictionary.size()) == Z_OK;
+  }
+}
+
+bool body::run(int flush)
+{
+  for (;;) {
+    if (size == out.size()) {
+      pool->grow(out, size, size + 1);
+    }
+
+    zs->next_out = out.data() + size;
+    zs->avail_out = out.size() - size;
+
+    int r = deflate(zs.get(), flush);
+
+    size = out.size() - zs->avail_out;
+
+    if (r == Z_STREAM_END) {
+      return true;
+
+    } else if (r != Z_OK && r != Z_BUF_ERROR) {
+      return false;
+
+    } else if (flush != Z_FINISH && zs->avail_in == 0 && zs->avail_out > 0) {
+      return true;
+    }
+  }
+}
+
+void body::add(const uint8_t *data, size_t n)
+{
+  if (!ok) {
+    return;
+  }
+
+  if (!with_dictionary && head.size() < max_dictionary) {
+    head.append((const char *) data,
+        std::min(n, max_dictionary - head.size()));
+  }
+
+  zs->next_in = (Bytef *) data;
+  zs->avail_in = n;
+
+  ok = run(Z_NO_FLUSH);
+
+  len += n;
+}
+
+bool body::finish()
+{
+  if (ok) {
+    ok = run(Z_FINISH);
+  }
+
+  return ok;
+}
+
+std::optional<record> writer::append(const std::string &url, time_t date, body &b)
+{
+  if (!b.finish()) {
+    spdlog::warn("error compressing {}", url);
+    return {};
+  }
+
+  if (fd < 0 || offset >= max_size) {
+    if (!next_segment()) {
+      return {};
+    }
+  }
+
+  if (dictionary.empty() && !b.head.empty()) {
+    dictionary = b.head;
+
+    if (!write_dictionary()) {
+      return {};
+    }
+  }
+
+  char date_s[32];
+  struct tm tm;
+  gmtime_r(&date, &tm);
+  strftime(date_s, sizeof(date_s), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+  std::string dictionary_field;
+  if (b.with_dictionary) {
+    dictionary_field = fmt::format("WARC-Dictionary-Offset: {}\r\n", dictionary_offset);
+  }
+
+  auto header = fmt::format(
+      "WARC/1.0\r\n"
+      "WARC-Type: resource\r\n"
+      "WARC-Target-URI: {}\r\n"
+      "WARC-Date: {}\r\n"
+      "{}"
+      "Content-Encoding: deflate\r\n"
+      "Content-Length: {}\r\n"
+      "\r\n",
+      url, date_s, dictionary_field, b.size);
+
+  return write_record(header, b.out.data(), b.size);
+}
+
+std::optional<record> writer::write_record(const std::string &header,
+    const uint8_t *body, size_t len)
+{
+  static const char trailer[] = "\r\n\r\n";
+
+  struct iovec iov[3];
+  iov[0].iov_base = (void *) header.data();
+  iov[0].iov_len = header.size();
+  iov[1].iov_base = (void *) body;
+  iov[1].iov_len = len;
+  iov[2].iov_base = (void *) trailer;
+  iov[2].iov_len = 4;
+
+  size_t size = header.size() + len + 4;
+
+  if (!write_all(fd, iov, 3, size)) {
+    spdlog::warn("error writing to segment {}", segment_path);
+
+    // Whatever made it out is junk, start again somewhere clean.
+    close();
+    return {};
+  }
+
+  record r{segment_path, offset, size};
+
+  offset += size;
+
+  return r;
+}
+
+struct header {
+  size_t body_offset;
+  size_t len;
+
+  bool deflate{false};
+  std::optional<uint64_t> dictionary_offset;
+};
+
+static const char *find_field(const char *head, const char *end, const char *name)
+{
+  const char *f = strstr(head, name);
+  if (f == nullptr || f > end) {
+    return nullptr;
+  }
+
+  return f + strlen(name);
+}
+
+static std::optional<header> read_header(int fd, const std::string &path,
+    uint64_t offset, uint64_t size)
+{
+  char head[4096];
+
+  ssize_t head_len = pread(fd, head, std::min(sizeof(head) - 1, (size_t) size), offset);
+  if (head_len <= 0) {
+    return {};
+  }
+
+  head[head_len] = 0;
+
+  char *end = strstr(head, "\r\n\r\n");
+  if (end == nullptr) {
+    spdlog::warn("bad record header in {} at {}", path, offset);
+    return {};
+  }
+
+  auto cl = find_field(head, end, "\r\nContent-Length: ");
+  if (cl == nullptr) {
+    spdlog::warn("record with no length in {} at {}", path, offset);
+    return {};
+  }
+
+  header h;
+
+  h.len = strtoull(cl, nullptr, 10);
+  h.body_offset = end + 4 - head;
+
+  if (h.body_offset + h.len > size) {
+    spdlog::warn("record length past its end in {} at {}", path, offset);
+    return {};
+  }
+
+  auto ce = find_field(head, end, "\r\nContent-Encoding: ");
+  if (ce != nullptr) {
+    if (strncmp(ce, "deflate\r\n", 9) != 0) {
+      spdlog::warn("unknown record encoding in {} at {}", path, offset);
+      return {};
+    }
+
+    h.deflate = true;
+  }
+
+  auto d = find_field(head, end, "\r\nWARC-Dictionary-Offset: ");
+  if (d != nullptr) {
+    h.dictionary_offset = strtoull(d, nullptr, 10);
+  }
+
+  return h;
+}
+
+reader::~reader()
+{
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+bool reader::load_dictionary(uint64_t offset)
+{
+  if (dictionary_path == path && dictionary_offset == offset) {
+    return true;
+  }
+
+  auto h = read_header(fd, path, offset, max_dictionary + 4096);
+  if (!h || h->deflate || h->len > max_dictionary) {
+    spdlog::warn("bad dictionary in {} at {}", path, offset);
+    return false;
+  }
+
+  dictionary.resize(h->len);
+
+  if (pread(fd, dictionary.data(), h->len, offset + h->body_offset) != (ssize_t) h->len) {
+    dictionary_path.clear();
+    return false;
+  }
+
+  dictionary_path = path;
+  dictionary_offset = offset;
+
+  return true;
+}
+
+// Only reads as much of the record as it takes to fill buf.
+ssize_t reader::inflate_body(uint64_t offset, size_t len,
+    uint8_t *buf, size_t max)
+{
+  z_stream zs{};
+
+  if (inflateInit(&zs) != Z_OK) {
+    return -1;
+  }
+
+  chunk.resize(64 * 1024);
+
+  zs.next_out = buf;
+  zs.avail_out = max;
+
+  size_t read = 0;
+  int r = Z_OK;
+
+  while (zs.avail_out > 0 && r != Z_STREAM_END) {
+    if (zs.avail_in == 0) {
+      if (read == len) {
+        break;
+      }
+
+      ssize_t n = pread(fd, chunk.data(), std::min(chunk.size(), len - read), offset + read);
+      if (n <= 0) {
+        inflateEnd(&zs);
+        return -1;
+      }
+
+      read += n;
+
+      zs.next_in = chunk.data();
+      zs.avail_in = n;
+    }
+
+    r = inflate(&zs, Z_NO_FLUSH);
+
+    if (r == Z_NEED_DICT) {
+      if (dictionary_path != path) {
+        break;
+      }
+
+      r = inflateSetDictionary(&zs,
+          (const Bytef *) dictionary.data(), dictionary.size());
+    }
+
+    if (r != Z_OK && r != Z_STREAM_END) {
+      break;
+    }
+  }
+
+  ssize_t out = max - zs.avail_out;
+
+  inflateEnd(&zs);
+
+  if (r != Z_OK && r != Z_STREAM_END) {
+    spdlog::warn("error inflating record in {} at {}", path, offset);
+    return -1;
+  }
+
+  return out;
+}
+
+ssize_t reader::read(const std::string &n_path, uint64_t offset, uint64_t size,
+    uint8_t *buf, size_t max)
+{
+  if (fd < 0 || path != n_path) {
+    if (fd >= 0) {
+      close(fd);
+    }
+
+    path = n_path;
+
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      spdlog::warn("error opening segment {}", path);
+      return -1;
+    }
+  }
+
+  auto h = read_header(fd, path, offset, size);
+  if (!h) {
+    return -1;
+  }
+
+  if (!h->deflate) {
+    return pread(fd, buf, std::min(h->len, max), offset + h->body_offset);
+  }
+
+  if (h->dictionary_offset && !load_dictionary(*h->dictionary_offset)) {
+    return -1;
+  }
+
+  return inflate_body(offset + h->body_offset, h->len, buf, max);
+}
+
+}
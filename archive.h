@@ -0,0 +1,150 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <ctime>
+#include <optional>
+
+#include <zlib.h>
+
+#include "buffer_pool.h"
+
+// Pages are kept in segment files as WARC style records, a text
+// header then the body. A page points at its record with the
+// segment's path, the offset and the size of the whole record.
+//
+// Bodies are deflated as they arrive against a dictionary taken
+// from the first page the writer is given, as pages on a site tend
+// to share most of their markup. Each segment starts with a record
+// holding the dictionary so segments can be read on their own.
+namespace archive {
+
+// zlib only uses the last 32k of a dictionary.
+static constexpr size_t max_dictionary = 32 * 1024;
+
+struct record {
+  std::string path;
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct deflate_end {
+  void operator()(z_stream *zs) {
+    deflateEnd(zs);
+    delete zs;
+  }
+};
+
+// A record body being deflated a chunk at a time, from
+// writer::start_body.
+struct body {
+  // Kept on the heap as zlib keeps a pointer back to it.
+  std::unique_ptr<z_stream, deflate_end> zs;
+
+  buffer_pool *pool;
+  std::vector<uint8_t> out;
+  size_t size{0};
+
+  // Uncompressed length.
+  size_t len{0};
+
+  // The start of the body, kept when there was no dictionary yet
+  // so it can become one.
+  std::string head;
+  bool with_dictionary{false};
+
+  bool ok{true};
+
+  body(const std::string &dictionary, buffer_pool *pool);
+  body(body &&o) = default;
+
+  ~body() {
+    pool->give(std::move(out));
+  }
+
+  void add(const uint8_t *data, size_t n);
+  bool finish();
+
+private:
+  bool run(int flush);
+};
+
+// Appends to {base}/{n}.warc, moving on to the next n once a
+// segment is over max_size. Segments that already exist are never
+// written to so records from past crawls stay where they are.
+struct writer {
+  std::string base;
+  size_t max_size;
+
+  size_t segment{0};
+  std::string segment_path;
+
+  int fd{-1};
+  uint64_t offset{0};
+
+  std::string dictionary;
+  uint64_t dictionary_offset{0};
+
+  writer(const std::string &base, size_t max_size)
+    : base(base), max_size(max_size)
+  {}
+
+  writer(writer &&o);
+  writer(const writer &o) = delete;
+
+  ~writer();
+
+  body start_body(buffer_pool *pool) {
+    return body(dictionary, pool);
+  }
+
+  std::optional<record> append(const std::string &url, time_t date, body &b);
+
+  void close();
+
+private:
+  bool next_segment();
+  bool write_dictionary();
+
+  std::optional<record> write_record(const std::string &header,
+      const uint8_t *body, size_t len);
+};
+
+// Reads record bodies, inflating them a chunk at a time. The last
+// segment and its dictionary are kept as a site's pages are mostly
+// read in the order they were written.
+struct reader {
+  std::string path;
+  int fd{-1};
+
+  std::string dictionary;
+  std::string dictionary_path;
+  uint64_t dictionary_offset{0};
+
+  std::vector<uint8_t> chunk;
+
+  reader() {}
+  ~reader();
+
+  reader(const reader &o) = delete;
+
+  // Reads up to max bytes of the body, returns the length read or
+  // -1 if the record could not be read.
+  ssize_t read(const std::string &path, uint64_t offset, uint64_t size,
+      uint8_t *buf, size_t max);
+
+private:
+  bool load_dictionary(uint64_t offset);
+
+  ssize_t inflate_body(uint64_t offset, size_t len,
+      uint8_t *buf, size_t max);
+};
+
+}
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Buffers handed out in power of two size classes from min_size
+// up. Given back buffers are kept for the next taker of that class
+// until max_idle bytes are sitting unused, past that they are
+// freed, so memory follows what is in flight rather than what
+// could be.
+class buffer_pool {
+  size_t min_size;
+  size_t max_idle;
+
+  size_t idle{0};
+
+  std::vector<std::vector<std::vector<uint8_t>>> free;
+
+  size_t class_of(size_t n) const {
+    size_t c = 0;
+    while ((min_size << c) < n) {
+      c++;
+    }
+
+    return c;
+  }
+
+public:
+  buffer_pool(size_t min_size, size_t max_idle)
+    : min_size(min_size), max_idle(max_idle)
+  {}
+
+  buffer_pool(const buffer_pool &o) = delete;
+
+  size_t idle_size() const {
+    return idle;
+  }
+
+  // A buffer of at least n bytes.
+  std::vector<uint8_t> take(size_t n) {
+    auto c = class_of(n);
+
+    if (c < free.size() && !free[c].empty()) {
+      auto b = std::move(free[c].back());
+      free[c].pop_back();
+
+      idle -= b.size();
+
+      return b;
+    }
+
+    return std::vector<uint8_t>(min_size << c);
+  }
+
+  void give(std::vector<uint8_t> &&b) {
+    if (b.empty()) {
+      return;
+    }
+
+    auto c = class_of(b.size());
+
+    // Not one of ours, or nowhere to keep it.
+    if ((min_size << c) != b.size() || idle + b.size() > max_idle) {
+      std::vector<uint8_t>().swap(b);
+      return;
+    }
+
+    if (free.size() <= c) {
+      free.resize(c + 1);
+    }
+
+    idle += b.size();
+    free[c].push_back(std::move(b));
+  }
+
+  // Swaps b for a buffer of at least n bytes holding b's first
+  // used bytes.
+  void grow(std::vector<uint8_t> &b, size_t used, size_t n) {
+    if (b.size() >= n) {
+      return;
+    }
+
+    auto n_b = take(n);
+    if (used > 0) {
+      memcpy(n_b.data(), b.data(), used);
+    }
+
+    give(std::move(b));
+    b = std::move(n_b);
+  }
+};
+
+#endif
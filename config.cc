@@ -36,10 +36,14 @@ config default_config() {
   c.crawler.site_data_path = "out/sites_data/";
   c.crawler.site_meta_path = "out/sites_meta/";
   c.crawler.sites_path = "out/sites.json";
+  c.crawler.registry_path = "out/sites.log";
+  c.crawler.site_cache_size = 512 * 1024 * 1024;
+  c.crawler.shards = 1;
 
   c.crawler.thread_max_sites = 5;
   c.crawler.thread_max_connections = 100;
   c.crawler.site_max_connections = 5;
+  c.crawler.site_requests_per_second = 2;
   c.crawler.max_site_part_size = 100 * 1024 * 1024;
   c.crawler.max_page_size = 10 * 1024 * 1024;
 
@@ -50,6 +54,7 @@ config default_config() {
   c.indexer.max_index_part_size = 10 * 1024 * 1024;
   c.indexer.htcap = 1 << 16;
   c.indexer.sites_per_part = 100;
+  c.indexer.positions = false;
 
   c.indexer.parts_path = "out/index_parts/";
   c.indexer.meta_path = "out/index_parts.json";
@@ -61,6 +66,9 @@ config default_config() {
   c.merger.parts_path = "out/index_merged/";
   c.merger.meta_path = "out/merged.json";
 
+  c.searcher.shards = 1;
+  c.searcher.shard_timeout_ms = 2000;
+
   c.index_parts = 30;
   c.index_meta_path = "out/index_meta.json";
 
@@ -93,10 +101,20 @@ config read_config(std::string path) {
   j.at("crawler").at("site_data_path").get_to(c.crawler.site_data_path);
   j.at("crawler").at("site_meta_path").get_to(c.crawler.site_meta_path);
   j.at("crawler").at("sites_path").get_to(c.crawler.sites_path);
+  j.at("crawler").at("registry_path").get_to(c.crawler.registry_path);
+
+  j.at("crawler").at("site_cache_mb").get_to(s_mb);
+  c.crawler.site_cache_size = s_mb * 1024 * 1024;
+
+  j.at("crawler").at("shards").get_to(c.crawler.shards);
+  if (c.crawler.shards == 0) {
+    c.crawler.shards = 1;
+  }
 
   j.at("crawler").at("thread_max_sites").get_to(c.crawler.thread_max_sites);
   j.at("crawler").at("thread_max_connections").get_to(c.crawler.thread_max_connections);
   j.at("crawler").at("site_max_connections").get_to(c.crawler.site_max_connections);
+  j.at("crawler").at("site_requests_per_second").get_to(c.crawler.site_requests_per_second);
   j.at("crawler").at("max_site_part_size_mb").get_to(s_mb);
   c.crawler.max_site_part_size = s_mb * 1024 * 1024;
   j.at("crawler").at("max_page_size_mb").get_to(s_mb);
@@ -116,6 +134,7 @@ config read_config(std::string path) {
   c.indexer.htcap = 1 << s;
 
   j.at("indexer").at("sites_per_part").get_to(c.indexer.sites_per_part);
+  j.at("indexer").at("positions").get_to(c.indexer.positions);
 
   j.at("indexer").at("parts_path").get_to(c.indexer.parts_path);
   j.at("indexer").at("meta_path").get_to(c.indexer.meta_path);
@@ -130,6 +149,9 @@ config read_config(std::string path) {
   j.at("merger").at("parts_path").get_to(c.merger.parts_path);
   j.at("merger").at("meta_path").get_to(c.merger.meta_path);
 
+  j.at("searcher").at("shards").get_to(c.searcher.shards);
+  j.at("searcher").at("shard_timeout_ms").get_to(c.searcher.shard_timeout_ms);
+
   j.at("scores_path").get_to(c.scores_path);
 
   file.close();
@@ -24,6 +24,8 @@ struct config {
     size_t thread_max_sites;
     size_t thread_max_connections;
     size_t site_max_connections;
+    // Before any Crawl-delay a site asks for.
+    double site_requests_per_second;
     size_t max_site_part_size;
     size_t max_page_size;
 
@@ -32,6 +34,13 @@ struct config {
     std::string site_data_path;
     std::string site_meta_path;
     std::string sites_path;
+    std::string registry_path;
+
+    size_t site_cache_size;
+
+    // Sites are split between this many threads in the master
+    // by host.
+    size_t shards;
   } crawler;
 
   size_t index_parts;
@@ -44,6 +53,10 @@ struct config {
 
     size_t htcap;
 
+    // Store word positions so phrases are matched from the word
+    // index instead of separate pair and trine indexes.
+    bool positions;
+
     std::string meta_path;
     std::string parts_path;
   } indexer;
@@ -59,6 +72,11 @@ struct config {
     std::string parts_path;
   } merger;
 
+  struct {
+    size_t shards;
+    size_t shard_timeout_ms;
+  } searcher;
+
   std::string scores_path;
 };
 
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <cstdlib>
 #include <cstring>
@@ -23,7 +24,14 @@
 #include "spdlog/spdlog.h"
 
 #include "util.h"
+#include "hash.h"
 #include "crawler.h"
+#include "site_view.h"
+
+#include "indexer.capnp.h"
+
+#include <kj/io.h>
+#include <capnp/serialize-packed.h>
 
 using namespace std::chrono_literals;
 using nlohmann::json;
@@ -53,31 +61,224 @@ void from_json(const nlohmann::json &j, site &s)
   s.scraped = s.last_scanned > 0;
 }
 
+// Starts a registry so a shard can tell it was written for a
+// different number of shards, whose hosts would hash elsewhere.
+// Registries from before it start with a record.
+struct registry_header {
+  uint32_t magic;
+  uint32_t shards;
+};
+
+const uint32_t registry_magic = 0x6b726567;
+
+static void write_header(int fd, const std::string &path, size_t shards)
+{
+  registry_header h{registry_magic, (uint32_t) shards};
+
+  if (write(fd, &h, sizeof(h)) != sizeof(h)) {
+    throw std::runtime_error(fmt::format("error writing {}", path));
+  }
+}
+
+static void write_record(int fd, const site &s)
+{
+  ::capnp::MallocMessageBuilder message;
+
+  SiteRecord::Builder r = message.initRoot<SiteRecord>();
+
+  r.setPath(s.path);
+  r.setHost(s.host);
+  r.setLevel(s.level);
+  r.setMaxPages(s.max_pages);
+  r.setPageCount(s.page_count);
+  r.setLastScanned(s.last_scanned);
+
+  writePackedMessageToFd(fd, message);
+}
+
+size_t shard_of(const std::string &host, size_t shards)
+{
+  return hash(host, 1 << 16) % shards;
+}
+
+void crawler::mark_dirty(site *s)
+{
+  if (!s->dirty) {
+    s->dirty = true;
+    dirty_sites.push_back(s);
+  }
+}
+
+// Saving a site can change its page count and move it from json
+// to capnp, both of which are in its record.
+void crawler::site_changed(site *s, const std::string &old_path)
+{
+  if (s->path != old_path) {
+    sites_path_map.erase(old_path);
+    sites_path_map.emplace(s->path, s);
+  }
+
+  mark_dirty(s);
+}
+
+// Only the sites that changed since the last save are appended.
 void crawler::save()
 {
-  spdlog::debug("save {}", sites_path);
+  // A new registry needs its header.
+  if (registry_records == 0 || registry_records > 2 * sites.size()) {
+    compact();
+    return;
+  }
 
-  std::ofstream file;
+  if (dirty_sites.empty()) {
+    return;
+  }
 
-  json j = {
-    {"sites", sites}
-  };
+  spdlog::debug("save {} sites to {}", dirty_sites.size(), registry_path);
 
-  file.open(sites_path, std::ios::out | std::ios::trunc);
+  int fd = open(registry_path.c_str(), O_WRONLY|O_CREAT|O_APPEND, 0664);
+  if (fd < 0) {
+    spdlog::warn("error opening file {}", registry_path);
+    throw std::runtime_error(fmt::format("error opening file {}", registry_path));
+  }
 
-  if (!file.is_open()) {
-    spdlog::warn("error opening file {}", sites_path);
-    throw std::runtime_error(fmt::format("error opening file {}", sites_path));
+  for (auto s: dirty_sites) {
+    write_record(fd, *s);
+    s->dirty = false;
   }
 
-  file << j;
+  close(fd);
 
-  file.close();
+  registry_records += dirty_sites.size();
+  dirty_sites.clear();
 
-  spdlog::debug("save {} finished", sites_path);
+  spdlog::debug("save {} finished", registry_path);
 }
 
-void crawler::load()
+void crawler::compact()
+{
+  spdlog::info("compact {} with {} records for {} sites",
+      registry_path, registry_records, sites.size());
+
+  auto tmp_path = fmt::format("{}.tmp", registry_path);
+
+  int fd = open(tmp_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0664);
+  if (fd < 0) {
+    spdlog::warn("error opening file {}", tmp_path);
+    throw std::runtime_error(fmt::format("error opening file {}", tmp_path));
+  }
+
+  write_header(fd, tmp_path, shards);
+
+  for (auto &s: sites) {
+    write_record(fd, s);
+    s.dirty = false;
+  }
+
+  fsync(fd);
+  close(fd);
+
+  if (rename(tmp_path.c_str(), registry_path.c_str()) != 0) {
+    throw std::runtime_error(fmt::format("error replacing {}", registry_path));
+  }
+
+  registry_records = sites.size();
+  dirty_sites.clear();
+
+  spdlog::info("compact {} finished", registry_path);
+}
+
+bool crawler::load_registry(const std::string &path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  spdlog::debug("load {}", path);
+
+  registry_header h;
+  bool have_header = read(fd, &h, sizeof(h)) == sizeof(h) && h.magic == registry_magic;
+
+  if (!have_header) {
+    lseek(fd, 0, SEEK_SET);
+  }
+
+  // The records in this shard's own registry were all routed by
+  // the count it was written with.
+  if (have_header && path == registry_path && h.shards != shards) {
+    close(fd);
+    throw std::runtime_error(fmt::format(
+          "{} was written for {} crawler shards, not {}",
+          path, h.shards, shards));
+  }
+
+  std::unordered_map<std::string, site*> by_host;
+
+  bool torn = false;
+
+  {
+    kj::FdInputStream input(fd);
+    kj::BufferedInputStreamWrapper buffered(input);
+
+    capnp::ReaderOptions opts;
+    opts.traversalLimitInWords = 128 * 1024 * 1024;
+
+    try {
+      while (buffered.tryGetReadBuffer().size() > 0) {
+        ::capnp::PackedMessageReader message(buffered, opts);
+
+        SiteRecord::Reader r = message.getRoot<SiteRecord>();
+
+        std::string host = r.getHost();
+
+        if (!owns(host)) {
+          continue;
+        }
+
+        site *s;
+
+        auto it = by_host.find(host);
+        if (it != by_host.end()) {
+          s = it->second;
+        } else {
+          s = &sites.emplace_back();
+          s->host = host;
+          by_host.emplace(host, s);
+        }
+
+        s->path = r.getPath();
+        s->level = r.getLevel();
+        s->max_pages = r.getMaxPages();
+        s->page_count = r.getPageCount();
+        s->last_scanned = r.getLastScanned();
+        s->scraped = s->last_scanned > 0;
+
+        registry_records++;
+      }
+
+    } catch (const kj::Exception &e) {
+      // Most likely a record cut short by a crash while saving.
+      spdlog::warn("failed to read {} after {} records: {}",
+          path, registry_records, std::string(e.getDescription()));
+
+      torn = true;
+    }
+  }
+
+  close(fd);
+
+  // Anything appended after a bad record would be lost, and a
+  // migrated shard needs its own registry with a header.
+  if (torn || path != registry_path || !have_header) {
+    compact();
+  }
+
+  return true;
+}
+
+// sites.json is only read to migrate to the registry.
+void crawler::load_json()
 {
   spdlog::debug("load {}", sites_path);
 
@@ -95,18 +296,58 @@ void crawler::load()
 
     j.at("sites").get_to(sites);
 
+    sites.remove_if(
+        [this] (auto &s) {
+          return !owns(s.host);
+        });
+
   } catch (const std::exception& e) {
     spdlog::warn("failed to load {}", sites_path);
   }
 
   file.close();
 
+  if (!sites.empty()) {
+    spdlog::info("migrating {} sites from {} to {}",
+        sites.size(), sites_path, registry_path);
+
+    compact();
+  }
+}
+
+void crawler::load()
+{
+  // Going back to one shard would read the unsharded registry as
+  // it was before the sites were split.
+  auto first_shard_path = fmt::format("{}.0", unsharded_registry_path);
+  if (shards == 1 && access(first_shard_path.c_str(), F_OK) == 0) {
+    throw std::runtime_error(fmt::format(
+          "{} was split between crawler shards, not 1", registry_path));
+  }
+
+  if (load_registry(registry_path)) {
+    // Loaded this shard's own registry.
+
+  } else if (shards > 1 && load_registry(unsharded_registry_path)) {
+    spdlog::info("migrated {} sites from {} to {}",
+        sites.size(), unsharded_registry_path, registry_path);
+
+  } else {
+    load_json();
+  }
+
   for (auto &site: sites) {
     sites_host_map.emplace(site.host, &site);
     sites_path_map.emplace(site.path, &site);
+
+    site.set_tracker(&loaded_sites);
+
+    site.seq = next_seq++;
+    update_frontier(&site);
   }
 
-  spdlog::debug("load {} finished", sites_path);
+  spdlog::debug("load finished, {} sites with {} ready to crawl",
+      sites.size(), frontier_ready.size());
 }
 
 site* crawler::find_site(const std::string &host)
@@ -133,6 +374,11 @@ site* crawler::add_site(const std::string &host, size_t level)
 {
   auto &site = sites.emplace_back(get_meta_path(host), host, level);
 
+  site.set_tracker(&loaded_sites);
+
+  site.seq = next_seq++;
+  mark_dirty(&site);
+
   sites_host_map.emplace(site.host, &site);
   sites_path_map.emplace(site.path, &site);
 
@@ -173,7 +419,7 @@ std::string crawler::get_data_path(const std::string &host) {
   return path;
 }
 
-bool crawler::check_blacklist(const std::string &host)
+bool crawler::check_blacklist(const std::string &host) const
 {
   for (auto &b: blacklist) {
     if (host.find(b) != std::string::npos) {
@@ -184,7 +430,7 @@ bool crawler::check_blacklist(const std::string &host)
   return false;
 }
 
-page* site::find_add_page(const std::string &url, size_t n_level, const std::string &path)
+page* site::find_add_page(const std::string &url, size_t n_level)
 {
   load();
 
@@ -195,98 +441,128 @@ page* site::find_add_page(const std::string &url, size_t n_level, const std::str
     return p;
   }
 
-  if (path != "") {
-    p = find_page_by_path(path);
-    if (p != NULL) {
-      return p;
-    }
-  }
-
-  return add_page(url, path);
+  return add_page(url, "");
 }
 
-void crawler::expand(
-    site *isite,
-    size_t max_add_sites,
-    size_t next_max_pages)
+// Only reads the site file and the blacklist so this can run off
+// the main thread while the crawler carries on.
+expansion crawler::find_expansion(
+    const std::string &site_path,
+    const std::string &site_host,
+    size_t max_add_sites) const
 {
+  expansion e;
+
   std::unordered_map<std::string, std::vector<uint32_t>> links_map;
-  
-  spdlog::info("expand {} starting", isite->host);
 
-  isite->load();
+  spdlog::info("expand {} starting", site_host);
+
+  site_view isite(site_path);
+  if (!isite.ok()) {
+    return e;
+  }
+
+  auto pages = isite.site.getPages();
+
+  e.page_count = pages.size();
 
-  for (auto &page: isite->pages) {
-    for (auto &l: page.links) {
-      auto &link_url = isite->urls[l.first];
+  for (auto page: pages) {
+    for (auto l: page.getLinks()) {
+      auto link_url = isite.get_url(l.getUrl());
       auto host = util::get_host(link_url);
 
       if (host == "") continue;
-      if (host == isite->host) continue;
+      if (host == site_host) continue;
 
       if (check_blacklist(host)) {
         continue;
       }
 
       auto it = links_map.try_emplace(host);
-      it.first->second.push_back(l.first);
+      it.first->second.push_back(l.getUrl());
     }
   }
 
-  spdlog::info("expand {} got {} links", isite->host, links_map.size());
-
-  std::list<std::pair<std::string, std::vector<uint32_t>>> links(links_map.begin(), links_map.end());
+  spdlog::info("expand {} got {} links", site_host, links_map.size());
 
-/*
-  for (auto &s: links_map) {
-    links.emplace_back(s.first, s.second);
-  }
-*/
+  std::vector<std::pair<std::string, std::vector<uint32_t>>> links(links_map.begin(), links_map.end());
 
-  links.sort([](auto &a, auto &b) {
+  std::sort(links.begin(), links.end(),
+    [](auto &a, auto &b) {
       return a.second.size() > b.second.size();
     });
-  
-  spdlog::info("expand {} sorted {} linkes", isite->host, links.size());
 
-  size_t add_sites = 0;
+  // At least one host is always added.
+  if (links.size() > std::max(max_add_sites, (size_t) 1)) {
+    links.resize(std::max(max_add_sites, (size_t) 1));
+  }
+
   for (auto &l: links) {
-    auto &host = l.first;
     auto &host_links = l.second;
 
-    auto o_site = find_site(host);
-    if (o_site == NULL) {
-      o_site = add_site(host, isite->level + 1);
-    }
-
-    size_t with_dups = host_links.size();
-
+    std::sort(host_links.begin(), host_links.end());
     auto it = std::unique(host_links.begin(), host_links.end());
     host_links.resize(std::distance(host_links.begin(), it));
 
-    spdlog::debug("expand {} adding {} ({} unique) links to {}",
-      isite->host, with_dups, host_links.size(), o_site->host);
+    auto &h = e.hosts.emplace_back(l.first, std::vector<std::string>());
 
-    for (auto l: host_links) {
-      auto &link_url = isite->urls[l]; 
-      o_site->find_add_page(link_url, isite->level + 1);
+    h.second.reserve(host_links.size());
+    for (auto id: host_links) {
+      h.second.push_back(isite.get_url(id));
     }
+  }
 
-    o_site->max_pages += next_max_pages;
-    add_sites++;
-
-    if (o_site->pages.size() < 5) {
-      o_site->flush();
-    }
+  return e;
+}
 
-    if (add_sites >= max_add_sites) {
-      break;
-    }
+void crawler::apply_expansion(
+    site *isite,
+    expansion &e,
+    size_t next_max_pages)
+{
+  for (auto &h: e.hosts) {
+    add_links(h.first, h.second, isite->level + 1, next_max_pages);
   }
-  
+
   spdlog::info("expand {} done", isite->host);
 }
 
+void crawler::add_links(
+    const std::string &host,
+    const std::vector<std::string> &urls,
+    size_t level,
+    size_t max_pages)
+{
+  auto o_site = find_site(host);
+  if (o_site == NULL) {
+    o_site = add_site(host, level);
+  }
+
+  spdlog::debug("adding {} links to {}", urls.size(), o_site->host);
+
+  for (auto &link_url: urls) {
+    o_site->find_add_page(link_url, level);
+  }
+
+  o_site->max_pages += max_pages;
+
+  update_frontier(o_site);
+  mark_dirty(o_site);
+
+  if (o_site->pages.size() < 5) {
+    o_site->flush();
+  }
+}
+
+void crawler::expand(
+    site *isite,
+    size_t max_add_sites,
+    size_t next_max_pages)
+{
+  auto e = find_expansion(isite->path, isite->host, max_add_sites);
+  apply_expansion(isite, e, next_max_pages);
+}
+
 void crawler::load_seed(std::vector<std::string> urls)
 {
   for (auto &o: urls) {
@@ -308,49 +584,116 @@ void crawler::load_seed(std::vector<std::string> urls)
 
     site->max_pages = levels[0].max_pages;
 
+    update_frontier(site);
+    mark_dirty(site);
+
     site->flush();
   }
 }
 
-bool crawler::have_next_site()
+bool crawler::can_crawl(site *s)
 {
-  for (auto &site: sites) {
-    if (site.scraping) continue;
-    if (site.scraped) continue;
-    if (site.max_pages == 0) continue;
-    if (site.level >= levels.size()) continue;
-
-    return true;
-  }
+  if (s->scraping) return false;
+  if (s->scraped) return false;
+  if (s->max_pages == 0) return false;
+  if (s->level >= levels.size()) return false;
 
-  return false;
+  return true;
 }
 
-site* crawler::get_next_site()
+// Must be called whenever anything can_crawl looks at changes
+// for a site, or its level or retry time.
+void crawler::update_frontier(site *s)
 {
-  site *s = NULL;
+  if (s->in_ready) {
+    frontier_ready.erase(ready_key(s->frontier_level, s->frontier_fails,
+          s->frontier_scanned, s->seq, s));
+    s->in_ready = false;
+  }
 
-  auto start = std::chrono::steady_clock::now();
+  if (s->in_delayed) {
+    frontier_delayed.erase(std::make_tuple(s->frontier_retry, s->seq, s));
+    s->in_delayed = false;
+  }
 
-  for (auto &site: sites) {
-    if (site.scraping) continue;
-    if (site.scraped) continue;
-    if (site.max_pages == 0) continue;
-    if (site.level >= levels.size()) continue;
+  if (!can_crawl(s)) {
+    return;
+  }
 
-    if (s == NULL || site.level < s->level) {
-      s = &site;
+  if (s->retry_after > time(NULL)) {
+    s->frontier_retry = s->retry_after;
+    frontier_delayed.emplace(s->frontier_retry, s->seq, s);
+    s->in_delayed = true;
+
+  } else {
+    s->frontier_level = s->level;
+    s->frontier_fails = s->fails;
+    s->frontier_scanned = s->last_scanned;
+    frontier_ready.emplace(s->frontier_level, s->frontier_fails,
+        s->frontier_scanned, s->seq, s);
+    s->in_ready = true;
+  }
+}
+
+void crawler::promote_delayed()
+{
+  time_t now = time(NULL);
+
+  while (!frontier_delayed.empty()) {
+    auto s = std::get<2>(*frontier_delayed.begin());
+    if (s->frontier_retry > now) {
+      break;
     }
+
+    update_frontier(s);
   }
+}
+
+// Back off sites that fail so a broken site does not get handed
+// straight back out.
+void crawler::crawl_failed(site *s)
+{
+  s->fails++;
+
+  time_t backoff = 60 << std::min(s->fails - 1, (size_t) 10);
+  s->retry_after = time(NULL) + backoff;
+
+  spdlog::info("crawl of {} failed {} times, retry in {}s",
+      s->host, s->fails, backoff);
+
+  update_frontier(s);
+}
+
+void crawler::crawl_succeeded(site *s)
+{
+  s->fails = 0;
+  s->retry_after = 0;
+
+  update_frontier(s);
+}
 
-  auto end = std::chrono::steady_clock::now();
-  std::chrono::duration<double, std::milli> elapsed = end - start;
-  if (elapsed.count() > 100) {
-    spdlog::warn("get next site took {}ms", elapsed.count());
+bool crawler::have_next_site()
+{
+  promote_delayed();
+
+  return !frontier_ready.empty();
+}
+
+// Takes the site out of the frontier as it is about to be crawled.
+site* crawler::get_next_site()
+{
+  promote_delayed();
+
+  if (frontier_ready.empty()) {
+    return NULL;
   }
 
+  auto s = std::get<4>(*frontier_ready.begin());
+
+  frontier_ready.erase(frontier_ready.begin());
+  s->in_ready = false;
+
   return s;
 }
 
 }
-
@@ -6,6 +6,10 @@
 #include <thread>
 #include <vector>
 #include <list>
+#include <set>
+#include <tuple>
+
+#include "spdlog/spdlog.h"
 
 #include "site.h"
 #include "config.h"
@@ -21,37 +25,106 @@ struct site : public site_map {
   bool scraped{false};
   bool scraping{false};
 
+  // Frontier state, see crawler::update_frontier.
+  uint64_t seq{0};
+  size_t fails{0};
+  time_t retry_after{0};
+
+  bool in_ready{false};
+  bool in_delayed{false};
+  size_t frontier_level{0};
+  size_t frontier_fails{0};
+  time_t frontier_scanned{0};
+  time_t frontier_retry{0};
+
+  // Needs a record written to the registry.
+  bool dirty{false};
+
   site() {}
 
   site(const std::string &p, const std::string &h, size_t l)
     : site_map(p, h), level(l)
   {}
 
-  page* find_add_page(const std::string &url, size_t level, const std::string &path = "");
+  page* find_add_page(const std::string &url, size_t level);
 };
 
 void to_json(nlohmann::json &j, const site &s);
 void from_json(const nlohmann::json &j, site &s);
 
+// The hosts a site links to, most linked first, with the urls
+// linked on each.
+struct expansion {
+  size_t page_count{0};
+  std::vector<std::pair<std::string, std::vector<std::string>>> hosts;
+};
+
+// Which of n shards owns a host.
+size_t shard_of(const std::string &host, size_t shards);
+
 struct crawler {
+  // Only sites whose host hashes to this shard are kept.
+  size_t shard{0};
+  size_t shards{1};
+
   std::string site_data_path;
   std::string site_meta_path;
   std::string sites_path;
 
+  // Append only log of site records, a later record for a host
+  // replaces any before it. Compacted once it has grown to twice
+  // the number of sites. Each shard has its own, the unsharded
+  // one is read once to migrate. A registry written for another
+  // number of shards is refused rather than dropping the sites
+  // that no longer hash here.
+  std::string registry_path;
+  std::string unsharded_registry_path;
+  size_t registry_records{0};
+  std::vector<site*> dirty_sites;
+
   std::vector<crawl_level> levels;
 
   std::list<site> sites;
+  site_tracker loaded_sites;
+
   std::unordered_map<std::string, site*> sites_host_map;
   std::unordered_map<std::string, site*> sites_path_map;
 
   std::vector<std::string> blacklist;
 
-  crawler(const config &c)
-    : site_data_path(c.crawler.site_data_path),
+  // Sites that can be crawled now and sites waiting out a retry by
+  // deadline. Ready sites go by level, then hosts that have failed
+  // less, then hosts crawled least recently so one host is not
+  // handed out again while others wait, then the order they were
+  // added.
+  typedef std::tuple<size_t, size_t, time_t, uint64_t, site*> ready_key;
+
+  std::set<ready_key> frontier_ready;
+  std::set<std::tuple<time_t, uint64_t, site*>> frontier_delayed;
+  uint64_t next_seq{0};
+
+  crawler(const config &c, size_t s = 0, size_t n = 1)
+    : shard(s), shards(n),
+      site_data_path(c.crawler.site_data_path),
       site_meta_path(c.crawler.site_meta_path),
       sites_path(c.crawler.sites_path),
-      levels(c.crawler.levels)
-  {}
+      registry_path(n > 1
+          ? fmt::format("{}.{}", c.crawler.registry_path, s)
+          : c.crawler.registry_path),
+      unsharded_registry_path(c.crawler.registry_path),
+      levels(c.crawler.levels),
+      loaded_sites(c.crawler.site_cache_size / n)
+  {
+    loaded_sites.on_meta_change = [this] (site_map *m, const std::string &old_path) {
+        site_changed(static_cast<site *>(m), old_path);
+      };
+  }
+
+  crawler(const crawler &o) = delete;
+
+  bool owns(const std::string &host) const {
+    return shard_of(host, shards) == shard;
+  }
 
   site* find_site(const std::string &host);
   site* find_site_by_path(const std::string &path);
@@ -63,7 +136,13 @@ struct crawler {
     blacklist = b;
   }
 
-  bool check_blacklist(const std::string &host);
+  bool check_blacklist(const std::string &host) const;
+
+  bool can_crawl(site *s);
+  void update_frontier(site *s);
+  void promote_delayed();
+  void crawl_failed(site *s);
+  void crawl_succeeded(site *s);
 
   bool have_next_site();
   site* get_next_site();
@@ -73,14 +152,37 @@ struct crawler {
     size_t max_add_sites,
     size_t next_max_page);
 
+  expansion find_expansion(
+    const std::string &site_path,
+    const std::string &site_host,
+    size_t max_add_sites) const;
+
+  void apply_expansion(
+    site *isite,
+    expansion &e,
+    size_t next_max_pages);
+
+  void add_links(
+    const std::string &host,
+    const std::vector<std::string> &urls,
+    size_t level,
+    size_t max_pages);
+
   std::string get_meta_path(const std::string &host);
   std::string get_data_path(const std::string &host);
 
   //scrape::site make_scrape_site(site *s,
  //   size_t site_max_con, size_t max_site_part_size, size_t max_page_size);
 
+  void mark_dirty(site *s);
+  void site_changed(site *s, const std::string &old_path);
+
   void save();
   void load();
+
+  bool load_registry(const std::string &path);
+  void load_json();
+  void compact();
 };
 
 
@@ -26,6 +26,7 @@
 #include "crawler.h"
 
 #include "curl_kj.h"
+#include "buffer_pool.h"
 
 #include "indexer.capnp.h"
 
@@ -46,6 +47,11 @@ using nlohmann::json;
 class CrawlerImpl final: public Crawler::Server,
                          public kj::TaskSet::ErrorHandler {
 
+  struct adaptor;
+
+  typedef scrape::site::clock clock;
+  typedef std::multimap<clock::time_point, adaptor *> schedule_map;
+
   struct adaptor {
   public:
     adaptor(kj::PromiseFulfiller<void> &fulfiller,
@@ -61,6 +67,13 @@ class CrawlerImpl final: public Crawler::Server,
     }
 
     void finish() {
+      auto results = context.getResults();
+      results.setFreeSlots(crawler->free_slots());
+
+      // Pages that came back 304 or were skipped by sitemap dates
+      // do not count. Folding a page into another changes the site.
+      results.setChangedPages(site.url_scanned.size() + site.folded);
+
       fulfiller.fulfill();
     }
 
@@ -68,22 +81,24 @@ class CrawlerImpl final: public Crawler::Server,
     CrawlerImpl *crawler;
     CrawlContext context;
     scrape::site site;
+
+    std::optional<schedule_map::iterator> scheduled;
   };
 
 public:
   CrawlerImpl(kj::AsyncIoContext &io_context, const config &settings)
-    : settings(settings), tasks(*this),
+    : settings(settings),
+      // Enough spare to cover a couple of the biggest pages.
+      pool(16 * 1024, 2 * settings.crawler.max_page_size),
+      tasks(*this),
+      timer(io_context.provider->getTimer()),
       curl(io_context, settings.crawler.thread_max_connections),
       max_sites(settings.crawler.thread_max_sites),
       max_ops(settings.crawler.thread_max_connections)
   {}
 
-  kj::Promise<void> canCrawl(CanCrawlContext context) override {
-    bool have_space = ops.size() < max_ops && adaptors.size() < max_sites;
-
-    context.getResults().setHaveSpace(have_space);
-
-    return kj::READY_NOW;
+  size_t free_slots() {
+    return adaptors.size() < max_sites ? max_sites - adaptors.size() : 0;
   }
 
   kj::Promise<void> crawl(CrawlContext context) override {
@@ -98,84 +113,156 @@ public:
     scrape::site scrape_site(
         site_path, data_path, max_pages,
         settings.crawler.site_max_connections,
+        settings.crawler.site_requests_per_second,
         settings.crawler.max_site_part_size,
-        settings.crawler.max_page_size);
+        settings.crawler.max_page_size,
+        &pool);
 
     return kj::newAdaptedPromise<void, adaptor>(this, kj::mv(context), std::move(scrape_site));
   }
 
   void add_adaptor(adaptor *a) {
     adaptors.push_back(a);
+
+    schedule_site(a, clock::now());
     process();
   }
 
-  void process() {
-    auto a = adaptors.begin();
+  // Puts a site in line to be looked at, keeping whichever time is
+  // sooner if it already is.
+  void schedule_site(adaptor *a, clock::time_point at) {
+    if (a->scheduled) {
+      if ((*a->scheduled)->first <= at) {
+        return;
+      }
 
-    bool all_blocked = true;
+      schedule.erase(*a->scheduled);
+    }
 
-    while (a != adaptors.end()) {
-      auto &s = (*a)->site;
+    a->scheduled = schedule.emplace(at, a);
+  }
 
-      if (s.finished()) {
-        spdlog::info("finished {}", s.host);
+  // Starts what it can for the sites that are due, soonest first,
+  // while there are connections to spare. Then sleeps until the
+  // next one is due or an op finishes.
+  void process() {
+    auto now = clock::now();
 
-        s.save();
+    while (!schedule.empty() && ops.size() < max_ops) {
+      auto it = schedule.begin();
+      if (it->first > now) {
+        break;
+      }
 
-        (*a)->finish();
-        a = adaptors.erase(a);
+      auto a = it->second;
+      schedule.erase(it);
+      a->scheduled = {};
 
-        continue;
-      }
+      start_ops(a, now);
+    }
 
-      if (ops.size() + 1 >= max_ops) {
-        spdlog::info("at max ops {}", ops.size());
-        break;
-      }
+    spdlog::debug("crawler has {} ops, {} sites waiting, {} idle in pool",
+        ops.size(), schedule.size(), pool.idle_size());
 
-      auto m_op = s.get_next();
-      if (m_op) {
-        auto op = *m_op;
+    arm_timer(now);
+  }
 
-        ops.emplace_back(op);
+  void start_ops(adaptor *a, clock::time_point now) {
+    auto &s = a->site;
 
-        tasks.add(curl.add(op->url, op->buf, op->buf_max).then(
-          [this, op] (curl_response response) {
-            op->size = response.size;
+    if (s.finished() && s.active_ops == 0) {
+      spdlog::info("finished {}", s.host);
 
-            if (response.success) {
-              op->finish(response.done_url);
-            } else {
-              op->finish_bad(true);
-            }
+      s.save();
 
-            ops.remove(op);
-            delete op;
+      // Removed first so the free slots sent back count it.
+      adaptors.remove(a);
+      a->finish();
 
-            process();
-          }));
+      return;
+    }
+
+    while (ops.size() < max_ops) {
+      auto at = s.ready_at(now);
+      if (at > now) {
+        schedule_site(a, at);
+        return;
+      }
 
-        all_blocked = false;
+      auto m_op = s.get_next();
+      if (!m_op) {
+        // Waiting on its own ops, one of them finishing puts it
+        // back in line.
+        return;
       }
 
-      a++;
+      s.spend_token();
+      start_op(a, *m_op);
     }
 
-    if (!all_blocked) {
-      spdlog::debug("not all blocked, call again");
-      process();
+    // Out of connections, first in line for when one frees up.
+    schedule_site(a, now);
+  }
 
-    } else {
-      spdlog::info("crawler all blocked with {} sites", adaptors.size());
+  void start_op(adaptor *a, scrape::site_op *op) {
+    ops.emplace_back(op);
+
+    tasks.add(curl.add(op->url,
+          [op] (const uint8_t *data, size_t n) {
+            return op->write(data, n);
+          },
+          [op] (size_t len) {
+            return op->expect(len);
+          },
+          op->if_modified_since, op->etag).then(
+      [this, a, op] (curl_response response) {
+        if (response.success && response.http_code == 304) {
+          op->finish_unchanged();
+
+        } else if (response.success) {
+          op->etag = std::move(response.etag);
+          op->finish(response.done_url);
+        } else {
+          op->finish_bad(true);
+        }
+
+        ops.remove(op);
+        delete op;
+
+        schedule_site(a, clock::now());
+        process();
+      }));
+  }
 
-      for (auto a: adaptors) {
-        spdlog::info("crawling {}:{}/{} : {} with {} ops",
-            a->site.url_pending.size(),
-            a->site.url_scanned.size(),
-            a->site.max_pages,
-            a->site.host, a->site.using_bufs.size());
-      }
+  // The one timer, for the soonest site. Left alone when it is
+  // already set for that.
+  void arm_timer(clock::time_point now) {
+    if (schedule.empty() || ops.size() >= max_ops) {
+      timer_canceler.cancel("nothing to wait for");
+      armed_at = {};
+      return;
     }
+
+    auto at = schedule.begin()->first;
+    if (armed_at && *armed_at == at) {
+      return;
+    }
+
+    timer_canceler.cancel("rescheduled");
+    armed_at = at;
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(at - now).count();
+
+    tasks.add(timer_canceler.wrap(
+          timer.afterDelay(std::max(ms, (int64_t) 0) * kj::MILLISECONDS)).then(
+            [this] () {
+              timer_canceler.release();
+              armed_at = {};
+
+              process();
+            },
+            [] (auto e) {}
+          ));
   }
 
   void taskFailed(kj::Exception&& exception) override {
@@ -184,13 +271,25 @@ public:
   }
 
   const config &settings;
+
+  // Page and robots bodies for every site being crawled, before
+  // anything that could still hold one.
+  buffer_pool pool;
+
   kj::TaskSet tasks;
 
+  kj::Timer &timer;
+  kj::Canceler timer_canceler;
+  std::optional<clock::time_point> armed_at;
+
   curl_kj curl;
 
   std::list<adaptor*> adaptors;
   std::list<scrape::site_op*> ops;
 
+  // Sites to look at and when, a site is in here at most once.
+  schedule_map schedule;
+
   size_t max_sites;
   size_t max_ops;
 };
@@ -235,6 +334,7 @@ int main(int argc, char *argv[]) {
     spdlog::info("create request");
     auto request = master.registerCrawlerRequest();
     request.setCrawler(crawler);
+    request.setSlots(settings.crawler.thread_max_sites);
 
     spdlog::info("send crawler register");
 
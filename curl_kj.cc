@@ -1,5 +1,7 @@
 #include <unistd.h>
 
+#include <algorithm>
+
 #include "spdlog/spdlog.h"
 
 #include "kj/time.h"
@@ -82,9 +84,11 @@ struct curl_kj::adaptor {
 public:
   adaptor(kj::PromiseFulfiller<curl_response> &fulfiller,
           curl_kj *curl, CURL *easy,
-          uint8_t *buf, size_t max)
+          write_fn write, expect_fn expect,
+          curl_slist *headers)
       : fulfiller(fulfiller), curl(curl), easy(easy),
-        buf(buf), buf_max(max)
+        write(std::move(write)), expect(std::move(expect)),
+        headers(headers)
   {
     spdlog::trace("adaptor starting"); curl->start_get(this, easy);
   }
@@ -103,7 +107,8 @@ public:
   void finish(curl_response &&r) {
     spdlog::trace("adaptor finishing");
     easy = nullptr;
-    buf_max = 0;
+    write = nullptr;
+    expect = nullptr;
     fulfiller.fulfill(kj::mv(r));
   }
 
@@ -113,11 +118,14 @@ public:
 
   CURL *easy;
 
-  uint8_t *buf;
-  size_t buf_max;
+  write_fn write;
+  expect_fn expect;
   size_t size{0};
 
-  time_t last_modified;
+  std::string etag;
+
+  // Freed once the transfer is done.
+  curl_slist *headers{nullptr};
 };
 
 size_t handle_header_write_c(char *buffer, size_t size, size_t nitems, void *userp) {
@@ -134,15 +142,16 @@ size_t handle_header_write_c(char *buffer, size_t size, size_t nitems, void *use
       //return 0;
     }
 
-  } else if (strstr(buffer, "Last-Modified: ")) {
-    char *s = buffer + strlen("Last-Modified: ");
+  } else if (strncmp(buffer, "HTTP/", 5) == 0) {
+    // A new response after a redirect, only the last one counts.
+    adaptor->etag.clear();
 
-    if (strlen(s) > 25) {
-      tm tm;
-      strptime(s, "%a, %d %b %Y %H:%M:%S", &tm);
+  } else if (strncasecmp(buffer, "etag:", 5) == 0) {
+    char *s = buffer + 5;
+    while (*s == ' ') s++;
 
-      adaptor->last_modified = mktime(&tm);
-    }
+    size_t len = strcspn(s, "\r\n");
+    adaptor->etag = std::string(s, std::min(len, (size_t) 256));
   }
 
   return nitems * size;
@@ -158,11 +167,18 @@ size_t handle_buffer_write_c(void *contents, size_t sz, size_t nmemb, void *user
 
   size_t realsize = sz * nmemb;
 
-  if (adaptor->buf_max < adaptor->size + realsize) {
+  if (adaptor->size == 0 && adaptor->expect) {
+    curl_off_t len;
+    if (curl_easy_getinfo(adaptor->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &len) == CURLE_OK
+        && len >= 0 && !adaptor->expect(len)) {
+      return 0;
+    }
+  }
+
+  if (!adaptor->write || !adaptor->write((const uint8_t *) contents, realsize)) {
     return 0;
   }
 
-  memcpy(&(adaptor->buf[adaptor->size]), contents, realsize);
   adaptor->size += realsize;
 
   return realsize;
@@ -203,11 +219,19 @@ curl_kj::curl_kj(kj::AsyncIoContext &io_context, size_t max_op)
   curl_multi_setopt(multi_handle, CURLMOPT_SOCKETDATA, this);
   curl_multi_setopt(multi_handle, CURLMOPT_TIMERFUNCTION, start_timeout_c);
   curl_multi_setopt(multi_handle, CURLMOPT_TIMERDATA, this);
+
+  // The multi handle already pools connections. Everything runs on
+  // one thread so the share needs no locks.
+  share_handle = curl_share_init();
+
+  curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
 }
 
 curl_kj::~curl_kj()
 {
   curl_multi_cleanup(multi_handle);
+  curl_share_cleanup(share_handle);
 }
 
 void curl_kj::cancel(CURL *curl_handle)
@@ -227,11 +251,12 @@ void curl_kj::start_get(adaptor *adaptor, CURL *easy)
 }
 
 kj::Promise<curl_response> curl_kj::add(const std::string &url,
-      uint8_t *buf, size_t buf_max,
-      time_t last_accessed)
+      write_fn write,
+      expect_fn expect,
+      time_t if_modified_since,
+      const std::string &if_none_match)
 {
   //  	Accept: text/html
-  //  	If-Unmodified-Since: Sat, 29 Oct 1994 19:43:31 GMT
 
   CURL *easy = curl_easy_init();
 
@@ -248,12 +273,35 @@ kj::Promise<curl_response> curl_kj::add(const std::string &url,
 
   curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
 
+  curl_easy_setopt(easy, CURLOPT_SHARE, share_handle);
+
+  // A site is crawled over minutes, not curl's default 60s.
+  curl_easy_setopt(easy, CURLOPT_DNS_CACHE_TIMEOUT, 600L);
+
+  // Lets the response's Last-Modified be read back.
+  curl_easy_setopt(easy, CURLOPT_FILETIME, 1L);
+
+  // Servers answer 304 with no body if the page has not changed.
+  if (if_modified_since > 0) {
+    curl_easy_setopt(easy, CURLOPT_TIMECONDITION, (long) CURL_TIMECOND_IFMODSINCE);
+    curl_easy_setopt(easy, CURLOPT_TIMEVALUE_LARGE, (curl_off_t) if_modified_since);
+  }
+
+  curl_slist *headers = nullptr;
+  if (!if_none_match.empty()) {
+    auto h = fmt::format("If-None-Match: {}", if_none_match);
+    headers = curl_slist_append(headers, h.c_str());
+
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+  }
+
   char url_c[util::max_url_len];
   strncpy(url_c, url.c_str(), sizeof(url_c));
 
   curl_easy_setopt(easy, CURLOPT_URL, url_c);
 
-  return kj::newAdaptedPromise<curl_response, adaptor>(this, easy, buf, buf_max);
+  return kj::newAdaptedPromise<curl_response, adaptor>(this, easy,
+      std::move(write), std::move(expect), headers);
 }
 
 void curl_kj::check_multi_info()
@@ -268,20 +316,30 @@ void curl_kj::check_multi_info()
       char *done_url;
       adaptor *adaptor;
       long res_status;
+      curl_off_t filetime;
 
       curl_easy_getinfo(easy_handle, CURLINFO_EFFECTIVE_URL, &done_url);
       curl_easy_getinfo(easy_handle, CURLINFO_PRIVATE, &adaptor);
       curl_easy_getinfo(easy_handle, CURLINFO_RESPONSE_CODE, &res_status);
+      curl_easy_getinfo(easy_handle, CURLINFO_FILETIME_T, &filetime);
+
+      curl_slist *headers = nullptr;
+
+      add_stats(easy_handle);
 
       if (adaptor) {
         bool ret = res == CURLE_OK;
 
+        headers = adaptor->headers;
+        adaptor->headers = nullptr;
+
         curl_response response{
               res == CURLE_OK,
               (int) res_status,
               std::string(done_url),
-              adaptor->last_modified,
-              adaptor->size
+              filetime > 0 ? (time_t) filetime : 0,
+              adaptor->size,
+              std::move(adaptor->etag)
         };
 
         adaptor->finish(std::move(response));
@@ -289,10 +347,44 @@ void curl_kj::check_multi_info()
 
       curl_multi_remove_handle(multi_handle, easy_handle);
       curl_easy_cleanup(easy_handle);
+
+      curl_slist_free_all(headers);
     }
   }
 }
 
+void curl_kj::add_stats(CURL *easy)
+{
+  curl_off_t name_lookup = 0, connect = 0, tls = 0;
+  long connects = 0;
+
+  curl_easy_getinfo(easy, CURLINFO_NAMELOOKUP_TIME_T, &name_lookup);
+  curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME_T, &connect);
+  curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME_T, &tls);
+  curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+
+  // Each time includes the ones before it.
+  stats.fetches++;
+  stats.name_lookup += name_lookup;
+
+  if (connects > 0) {
+    stats.new_connections++;
+    stats.connect += std::max(connect - name_lookup, (curl_off_t) 0);
+
+    if (tls > 0) {
+      stats.tls += std::max(tls - connect, (curl_off_t) 0);
+    }
+  }
+
+  if (stats.fetches % 1000 == 0) {
+    spdlog::info("curl {} fetches, {} new connections, avg lookup {}ms, connect {}ms, tls {}ms",
+        stats.fetches, stats.new_connections,
+        stats.name_lookup / stats.fetches / 1000,
+        stats.connect / std::max(stats.new_connections, (size_t) 1) / 1000,
+        stats.tls / std::max(stats.new_connections, (size_t) 1) / 1000);
+  }
+}
+
 void curl_kj::handle_timeout(long timeout_ms)
 {
   timer_canceler.cancel("canceled");
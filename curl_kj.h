@@ -2,6 +2,7 @@
 #define CURL_KJ_H
 
 #include <chrono>
+#include <functional>
 
 #include <curl/curl.h>
 
@@ -17,6 +18,7 @@ struct curl_response {
   std::string done_url;
   time_t last_modified;
   size_t size;
+  std::string etag;
 };
 
 class curl_kj : public kj::TaskSet::ErrorHandler {
@@ -28,15 +30,38 @@ public:
 
   ~curl_kj();
 
+  // Body data is handed to write as it arrives, the transfer is
+  // dropped if write returns false.
+  typedef std::function<bool(const uint8_t *, size_t)> write_fn;
+
+  // Given the Content-Length before the body when there is one,
+  // the transfer is dropped if it returns false.
+  typedef std::function<bool(size_t)> expect_fn;
+
   kj::Promise<curl_response> add(const std::string &url,
-      uint8_t *buf, size_t buf_max,
-      time_t last_accessed = 0);
+      write_fn write,
+      expect_fn expect = nullptr,
+      time_t if_modified_since = 0,
+      const std::string &if_none_match = "");
 
   void handle_socket(curl_socket_t s, int action, void *socketp);
   void handle_timeout(long timeout_ms);
 
+  // Where fetches spend their time before the first byte is sent,
+  // summed in microseconds.
+  struct connect_stats {
+    size_t fetches{0};
+    size_t new_connections{0};
+    uint64_t name_lookup{0};
+    uint64_t connect{0};
+    uint64_t tls{0};
+  };
+
+  connect_stats stats;
+
 private:
   void check_multi_info();
+  void add_stats(CURL *easy);
 
   void on_timeout();
 
@@ -58,6 +83,10 @@ private:
   kj::Canceler timer_canceler;
 
   CURLM *multi_handle;
+
+  // Shares resolved names and TLS sessions between every handle
+  // added.
+  CURLSH *share_handle;
 };
 
 #endif
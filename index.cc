@@ -64,20 +64,134 @@ void index_reader::load()
   key_meta_backing.setup(buf + meta.key_meta_base);
   key_data_backing.setup(buf + meta.key_data_base);
   posting_backing.setup(buf + meta.posting_data_base);
+
+  positions = nullptr;
+  skip_meta = nullptr;
+  skips = nullptr;
+
+  if (meta.magic != index_magic) {
+    return;
+  }
+
+  if (meta.version > index_version) {
+    throw std::runtime_error(fmt::format("part {} has version {} > {}",
+          path, meta.version, index_version));
+  }
+
+  if (meta.flags & index_has_positions) {
+    positions = (position_reader *) (buf + meta.position_meta_base);
+    position_backing.setup(buf + meta.position_data_base);
+  }
+
+  if (meta.flags & index_has_skips) {
+    skip_meta = (skip_reader *) (buf + meta.skip_meta_base);
+    skips = (posting_skip *) (buf + meta.skip_data_base);
+  }
 }
 
-std::vector<post> index_reader::find(const std::string &s)
+std::optional<uint32_t> index_reader::find_posting(const std::string &s)
 {
   uint32_t hash_key = hash(s, htcap);
 
   auto &key_b = keys[hash_key];
-  auto posting_id = key_b.find(key_meta_backing, key_data_backing, s);
-  if (posting_id) {
-    auto &posting = postings[*posting_id];
-    return posting.decompress(posting_backing);
-  } else {
+  return key_b.find(key_meta_backing, key_data_backing, s);
+}
+
+// The last skip before any doc with an id of lo or more.
+const posting_skip *index_reader::skip_to(uint32_t posting_id, uint32_t lo)
+{
+  auto &m = skip_meta[posting_id];
+
+  size_t count = (m.docs + skip_interval - 1) / skip_interval;
+  if (count == 0) {
+    return nullptr;
+  }
+
+  auto begin = skips + m.first;
+  auto end = begin + count;
+
+  // Every doc in a block is after its prev_id.
+  auto it = std::partition_point(begin + 1, end,
+      [lo] (const posting_skip &k) { return k.prev_id < lo; });
+
+  return it - 1;
+}
+
+std::vector<post> index_reader::find(const std::string &s,
+    uint32_t lo, uint32_t hi, size_t *total)
+{
+  auto posting_id = find_posting(s);
+  if (!posting_id) {
     return {};
   }
+
+  auto &posting = postings[*posting_id];
+
+  if (skip_meta == nullptr) {
+    auto posts = posting.decompress(posting_backing);
+
+    if (total) {
+      *total = posts.size();
+    }
+
+    posts.erase(std::remove_if(posts.begin(), posts.end(),
+          [lo, hi] (const post &p) { return p.id < lo || p.id >= hi; }),
+        posts.end());
+
+    return posts;
+  }
+
+  if (total) {
+    *total = skip_meta[*posting_id].docs;
+  }
+
+  auto skip = skip_to(*posting_id, lo);
+  if (skip == nullptr) {
+    return {};
+  }
+
+  return posting.decompress(posting_backing, lo, hi, skip->offset, skip->prev_id);
+}
+
+std::vector<positional_post> index_reader::find_positions(const std::string &s,
+    uint32_t lo, uint32_t hi)
+{
+  if (!has_positions()) {
+    return {};
+  }
+
+  auto posting_id = find_posting(s);
+  if (!posting_id) {
+    return {};
+  }
+
+  auto &posting = postings[*posting_id];
+
+  std::vector<post> posts;
+  std::vector<std::vector<uint32_t>> doc_positions;
+
+  // From the skip the docs are decoded whole so they line up with
+  // their positions, those before lo are dropped after.
+  auto skip = skip_meta ? skip_to(*posting_id, lo) : nullptr;
+  if (skip) {
+    posts = posting.decompress(posting_backing, 0, hi, skip->offset, skip->prev_id);
+    doc_positions = positions[*posting_id].decompress(position_backing,
+        posts.size(), skip->pos_offset);
+  } else {
+    posts = posting.decompress(posting_backing, 0, hi);
+    doc_positions = positions[*posting_id].decompress(position_backing, posts.size());
+  }
+
+  std::vector<positional_post> result;
+  result.reserve(posts.size());
+
+  for (size_t i = 0; i < posts.size(); i++) {
+    if (posts[i].id >= lo) {
+      result.emplace_back(posts[i].id, std::move(doc_positions[i]));
+    }
+  }
+
+  return result;
 }
 
 void index_writer::write_buf(const std::string &path, uint8_t *buf, size_t len)
@@ -113,13 +227,16 @@ void index_writer::save(const std::string &path, uint8_t *buf, size_t max_len)
 
   size_t htable_size = htcap * sizeof(uint32_t) * 2;
   size_t posting_meta_size = postings.size() * sizeof(uint32_t) * 2;
+  size_t position_meta_size = positions ? posting_meta_size : 0;
 
-  size_t htable_base = 128;
+  size_t htable_base = index_meta_size;
   size_t key_meta_base = htable_base + htable_size;
   size_t posting_meta_base = key_meta_base + key_meta_size;
+  size_t position_meta_base = posting_meta_base + posting_meta_size;
 
-  size_t key_data_base = posting_meta_base + posting_meta_size;
+  size_t key_data_base = position_meta_base + position_meta_size;
   size_t posting_data_base = 0; // after key data
+  size_t position_data_base = 0; // after posting data
 
   if (key_data_base >= max_len) {
     throw std::runtime_error(fmt::format("too much data key data > max len. {} keys, {} postings",
@@ -185,7 +302,105 @@ void index_writer::save(const std::string &path, uint8_t *buf, size_t max_len)
     posting_data_offset += posting.len;
   }
 
+  position_data_base = posting_data_base + posting_data_offset;
+
+  uint32_t position_data_offset = 0;
+
+  if (positions) {
+    uint32_t *position_meta_data = (uint32_t *) (buf + position_meta_base);
+    uint8_t *position_data = buf + position_data_base;
+
+    for (size_t i = 0; i < postings.size(); i++) {
+      auto &posting = postings[i];
+
+      position_meta_data[i*2+0] = posting.pos_len;
+      position_meta_data[i*2+1] = position_data_offset;
+
+      if (posting.pos_len == 0) {
+        continue;
+      }
+
+      if (position_data_base + position_data_offset + posting.pos_len >= max_len) {
+        throw std::runtime_error(fmt::format("too much data position data > max len"));
+      }
+
+      uint8_t *data = position_backing->get_data(posting.pos_offset);
+
+      memcpy(position_data + position_data_offset, data, posting.pos_len);
+
+      position_data_offset += posting.pos_len;
+    }
+  }
+
+  // Skips are found from the postings as written.
+  size_t skip_meta_base = position_data_base + position_data_offset;
+  size_t skip_meta_size = postings.size() * sizeof(skip_reader);
+  size_t skip_data_base = skip_meta_base + skip_meta_size;
+
+  if (skip_data_base >= max_len) {
+    throw std::runtime_error(fmt::format("too much data skip meta > max len"));
+  }
+
+  skip_reader *skip_meta = (skip_reader *) (buf + skip_meta_base);
+  posting_skip *skip_data = (posting_skip *) (buf + skip_data_base);
+
+  uint32_t skip_count = 0;
+
+  for (size_t i = 0; i < postings.size(); i++) {
+    uint8_t *b = posting_data + posting_meta_data[i*2+1];
+    uint32_t len = posting_meta_data[i*2+0];
+
+    uint8_t *pb = nullptr;
+    uint32_t pos_len = 0;
+    if (positions) {
+      uint32_t *position_meta_data = (uint32_t *) (buf + position_meta_base);
+      pos_len = position_meta_data[i*2+0];
+      pb = buf + position_data_base + position_meta_data[i*2+1];
+    }
+
+    skip_meta[i].first = skip_count;
+
+    uint32_t docs = 0, o = 0, po = 0;
+    uint32_t id, prev_id = 0;
+
+    while (o < len) {
+      if (docs % skip_interval == 0) {
+        if (skip_data_base + (skip_count + 1) * sizeof(posting_skip) >= max_len) {
+          throw std::runtime_error(fmt::format("too much data skip data > max len"));
+        }
+
+        skip_data[skip_count++] = {prev_id, o, po};
+      }
+
+      o += vbyte_read(&b[o], &id);
+      prev_id += id;
+      o++;
+
+      docs++;
+
+      // On to the next doc's positions, past its separator.
+      if (pb) {
+        uint32_t v;
+        while (po < pos_len) {
+          po += vbyte_read(&pb[po], &v);
+          if (v == 0) {
+            break;
+          }
+        }
+      }
+    }
+
+    skip_meta[i].docs = docs;
+  }
+
+  size_t skip_data_size = skip_count * sizeof(posting_skip);
+
   index_meta *m = (index_meta *) buf;
+  memset(buf, 0, index_meta_size);
+
+  m->magic = index_magic;
+  m->version = index_version;
+  m->flags = index_has_skips | (positions ? index_has_positions : 0);
   m->htcap = htcap;
   m->htable_base = htable_base;
   m->htable_size = htable_size;
@@ -198,15 +413,24 @@ void index_writer::save(const std::string &path, uint8_t *buf, size_t max_len)
   m->posting_meta_size = posting_meta_size;
   m->posting_data_base = posting_data_base;
   m->posting_data_size = posting_data_offset;
-
-  spdlog::info("writing {} with k meta: {:4} kb k data: {:4} key, p meta: {:4} kb, p data: {:4}",
+  m->position_meta_base = position_meta_base;
+  m->position_meta_size = position_meta_size;
+  m->position_data_base = position_data_base;
+  m->position_data_size = position_data_offset;
+  m->skip_meta_base = skip_meta_base;
+  m->skip_meta_size = skip_meta_size;
+  m->skip_data_base = skip_data_base;
+  m->skip_data_size = skip_data_size;
+
+  spdlog::info("writing {} with k meta: {:4} kb k data: {:4} key, p meta: {:4} kb, p data: {:4}, pos data: {:4}",
     path,
     m->key_meta_size / 1024,
     m->key_data_size / 1024,
     m->posting_meta_size / 1024,
-    m->posting_data_size / 1024);
+    m->posting_data_size / 1024,
+    m->position_data_size / 1024);
 
-  write_buf(path, buf, posting_data_base + posting_data_offset);
+  write_buf(path, buf, skip_data_base + skip_data_size);
 }
 
 void index_writer::merge(index_reader &other, uint32_t page_id_offset)
@@ -234,27 +458,49 @@ void index_writer::merge(index_reader &other, uint32_t page_id_offset)
       auto &posting_other = other.postings[entry.posting_id];
 
       auto posting_id = key_m.find(key_meta_backing, key_data_backing, entry.key);
-      if (posting_id) {
-        auto &posting = postings.at(*posting_id);
-        posting.merge(posting_backing,
-              posting_other, other.posting_backing,
-              page_id_offset);
+      if (!posting_id) {
+        posting_id = postings.size();
+        postings.emplace_back();
+
+        key_m.add(key_meta_backing, key_data_backing, entry.key, *posting_id, key_base_items);
+      }
+
+      auto &posting = postings.at(*posting_id);
 
-      } else {
-        uint32_t new_id = postings.size();
-        auto &posting = postings.emplace_back();
+      bool first = posting.len == 0;
 
-        posting.merge(posting_backing,
-              posting_other, other.posting_backing,
-              page_id_offset);
+      size_t docs = posting.merge(posting_backing,
+            posting_other, other.posting_backing,
+            page_id_offset);
 
-        key_m.add(key_meta_backing, key_data_backing, entry.key, new_id, key_base_items);
+      if (positions) {
+        merge_positions(posting, first, other, entry.posting_id, docs);
       }
     }
   }
 }
 
-void index_writer::insert(const std::string &s, uint32_t page_id)
+// Parts without positions get empty lists so the docs stay
+// lined up with their positions.
+void index_writer::merge_positions(posting_writer &posting, bool first,
+    index_reader &other, uint32_t other_id, size_t docs)
+{
+  std::vector<std::vector<uint32_t>> doc_positions;
+
+  if (other.has_positions()) {
+    auto &positions_other = other.positions[other_id];
+    doc_positions = positions_other.decompress(other.position_backing, docs);
+  } else {
+    doc_positions.resize(docs);
+  }
+
+  for (auto &p: doc_positions) {
+    posting.append_positions(*position_backing, first, p);
+    first = false;
+  }
+}
+
+void index_writer::insert(const std::string &s, uint32_t page_id, uint32_t pos)
 {
   if (s.size() > key_max_len) {
     return;
@@ -265,17 +511,19 @@ void index_writer::insert(const std::string &s, uint32_t page_id)
   auto &key_b = keys[hash_key];
   auto posting_id = key_b.find(key_meta_backing, key_data_backing, s);
 
-  if (posting_id) {
-    auto &posting = postings[*posting_id];
-    posting.append(posting_backing, page_id);
+  if (!posting_id) {
+    posting_id = postings.size();
+    postings.emplace_back();
 
-  } else {
-    uint32_t new_id = postings.size();
-    auto &posting = postings.emplace_back();
+    key_b.add(key_meta_backing, key_data_backing, s, *posting_id, key_base_items);
+  }
 
-    posting.append(posting_backing, page_id);
+  auto &posting = postings[*posting_id];
 
-    key_b.add(key_meta_backing, key_data_backing, s, new_id, key_base_items);
+  if (positions) {
+    posting.append(posting_backing, *position_backing, page_id, pos);
+  } else {
+    posting.append(posting_backing, page_id);
   }
 }
 
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <optional>
 #include <chrono>
+#include <thread>
 #include <assert.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -16,6 +17,9 @@
 
 #include "hash.h"
 #include "vbyte.h"
+#include "simhash.h"
+
+struct site_view;
 
 namespace search {
 
@@ -173,11 +177,52 @@ struct post {
     : id(i), count(c) {}
 };
 
+struct positional_post {
+  uint32_t id;
+  std::vector<uint32_t> positions;
+
+  positional_post(uint32_t i, std::vector<uint32_t> &&p)
+    : id(i), positions(std::move(p)) {}
+};
+
 struct posting_reader {
   uint32_t len;
   uint32_t offset;
 
-  std::vector<post> decompress(read_backing &p);
+  // Only keeps the docs with ids in [lo, hi). Decoding can start
+  // part way in at byte o, with prev_id the id of the doc before.
+  std::vector<post> decompress(read_backing &p,
+      uint32_t lo = 0, uint32_t hi = UINT32_MAX,
+      uint32_t o = 0, uint32_t prev_id = 0);
+};
+
+// Positions are kept in their own stream with the same layout on
+// disk as the postings, one list for each doc in the posting.
+struct position_reader {
+  uint32_t len;
+  uint32_t offset;
+
+  // docs lists starting from byte o, which must be the start of a
+  // doc.
+  std::vector<std::vector<uint32_t>> decompress(read_backing &p, size_t docs,
+      uint32_t o = 0);
+};
+
+// Every skip_interval docs a posting has a skip so a reader after
+// a range of ids can start near it rather than decode it all.
+const uint32_t skip_interval = 64;
+
+struct posting_skip {
+  // The id before the block, 0 for the first.
+  uint32_t prev_id;
+  uint32_t offset;
+  uint32_t pos_offset;
+};
+
+struct skip_reader {
+  uint32_t docs;
+  // Index of the posting's first skip.
+  uint32_t first;
 };
 
 struct posting_writer {
@@ -185,12 +230,21 @@ struct posting_writer {
   uint32_t len{0}, max_len{0};
   uint32_t offset{0};
 
+  uint32_t last_pos{0};
+  uint32_t pos_len{0}, pos_max_len{0};
+  uint32_t pos_offset{0};
+
   posting_writer() {}
 
   uint8_t * ensure_size(write_backing &p, uint32_t need);
+  uint8_t * ensure_pos_size(write_backing &p, uint32_t need);
+
   void append(write_backing &p, uint32_t id, uint8_t count = 1);
+  void append(write_backing &p, write_backing &pp, uint32_t id, uint32_t pos);
+  void append_positions(write_backing &pp, bool first, const std::vector<uint32_t> &positions);
+
   // Can only read from readers
-  void merge(write_backing &p, posting_reader &other, read_backing &op, uint32_t id_offset);
+  size_t merge(write_backing &p, posting_reader &other, read_backing &op, uint32_t id_offset);
 };
 
 struct key_entry {
@@ -271,8 +325,37 @@ struct index_meta {
   uint32_t key_data_size;
   uint32_t posting_meta_size;
   uint32_t posting_data_size;
+
+  // Parts from before the magic was added have whatever was left
+  // in the buffer here. The header is zeroed when saved now so
+  // with the magic the rest can be trusted.
+  uint32_t magic;
+  uint32_t version;
+  uint32_t flags;
+
+  // Only set if flags has index_has_positions.
+  uint32_t position_meta_base;
+  uint32_t position_data_base;
+  uint32_t position_meta_size;
+  uint32_t position_data_size;
+
+  // Only set if flags has index_has_skips.
+  uint32_t skip_meta_base;
+  uint32_t skip_data_base;
+  uint32_t skip_meta_size;
+  uint32_t skip_data_size;
 };
 
+// The meta is the first index_meta_size bytes of a part.
+const size_t index_meta_size = 128;
+static_assert(sizeof(index_meta) <= index_meta_size);
+
+const uint32_t index_magic = 0x6b616b69;
+const uint32_t index_version = 3;
+
+const uint32_t index_has_positions = 1 << 0;
+const uint32_t index_has_skips = 1 << 1;
+
 struct index_reader {
   std::string path;
   uint8_t *buf{nullptr};
@@ -289,10 +372,19 @@ struct index_reader {
   posting_reader *postings{nullptr};
   size_t posting_count;
 
+  // array, same size as postings if the part has positions
+  position_reader *positions{nullptr};
+
+  // array, same size as postings if the part has skips, and the
+  // skips they point into.
+  skip_reader *skip_meta{nullptr};
+  posting_skip *skips{nullptr};
+
   // backings
   read_backing key_meta_backing;
   read_backing key_data_backing;
   read_backing posting_backing;
+  read_backing position_backing;
 
   index_reader(const std::string &path, size_t buf_len)
     : path(path), buf_len(buf_len)
@@ -309,13 +401,27 @@ struct index_reader {
     }
   }
 
+  bool has_positions() {
+    return positions != nullptr;
+  }
+
   void load();
-  std::vector<post> find(const std::string &s);
+  // Only the docs with ids in [lo, hi), total is set to how many
+  // docs have s at all.
+  std::vector<post> find(const std::string &s,
+      uint32_t lo = 0, uint32_t hi = UINT32_MAX, size_t *total = nullptr);
+  std::vector<positional_post> find_positions(const std::string &s,
+      uint32_t lo = 0, uint32_t hi = UINT32_MAX);
+
+private:
+  std::optional<uint32_t> find_posting(const std::string &s);
+  const posting_skip *skip_to(uint32_t posting_id, uint32_t lo);
 };
 
 struct index_writer {
   size_t htcap;
   uint16_t key_base_items;
+  bool positions;
 
   // hash
   //std::vector<key_block_writer> keys;
@@ -328,13 +434,22 @@ struct index_writer {
   write_backing key_data_backing;
   write_backing posting_backing;
 
+  // Only if positions.
+  std::optional<write_backing> position_backing;
+
   index_writer(size_t htcap, uint16_t key_base_items,
-               size_t key_m_b, size_t key_d_b, size_t post_b)
+               size_t key_m_b, size_t key_d_b, size_t post_b,
+               bool positions = false)
     : htcap(htcap), key_base_items(key_base_items),
+      positions(positions),
       key_meta_backing("key_meta", key_m_b),
       key_data_backing("key_data", key_d_b),
       posting_backing("postings", post_b)
   {
+    if (positions) {
+      position_backing.emplace("positions", post_b);
+    }
+
     keys = (key_block_writer *) malloc(sizeof(key_block_writer) * htcap);
     if (keys == nullptr) {
       throw std::bad_alloc();
@@ -350,11 +465,13 @@ struct index_writer {
   index_writer(index_writer &&o)
     : htcap(o.htcap),
       key_base_items(o.key_base_items),
+      positions(o.positions),
       keys(o.keys),
       postings(std::move(o.postings)),
       key_meta_backing(std::move(o.key_meta_backing)),
       key_data_backing(std::move(o.key_data_backing)),
-      posting_backing(std::move(o.posting_backing))
+      posting_backing(std::move(o.posting_backing)),
+      position_backing(std::move(o.position_backing))
   {
     o.keys = nullptr;
   }
@@ -366,12 +483,13 @@ struct index_writer {
   }
 
   std::string usage_str() {
-    return fmt::format("ht: {} kb, km: {} kb, kd: {} kb, pm: {} kb, pb: {} kb",
+    return fmt::format("ht: {} kb, km: {} kb, kd: {} kb, pm: {} kb, pb: {} kb, pp: {} kb",
            sizeof(key_block_writer) * htcap / 1024,
            key_meta_backing.usage() / 1024,
            key_data_backing.usage() / 1024,
            postings.size() * sizeof(posting_writer) / 1024,
-           posting_backing.usage() / 1024);
+           posting_backing.usage() / 1024,
+           position_backing ? position_backing->usage() / 1024 : 0);
   }
 
   size_t usage() {
@@ -379,6 +497,7 @@ struct index_writer {
            key_meta_backing.usage() +
            key_data_backing.usage() +
            posting_backing.usage() +
+           (position_backing ? position_backing->usage() : 0) +
            postings.size() * sizeof(posting_writer);
   }
 
@@ -390,12 +509,18 @@ struct index_writer {
     key_meta_backing.clear();
     key_data_backing.clear();
     posting_backing.clear();
+
+    if (position_backing) {
+      position_backing->clear();
+    }
   }
 
   void write_buf(const std::string &path, uint8_t *buf, size_t len);
   void save(const std::string &path, uint8_t *buf, size_t max_len);
   void merge(index_reader &other, uint32_t page_id_offset);
-  void insert(const std::string &s, uint32_t page_id);
+  void merge_positions(posting_writer &posting, bool first,
+      index_reader &other, uint32_t other_id, size_t docs);
+  void insert(const std::string &s, uint32_t page_id, uint32_t pos = 0);
 };
 
 struct index_info {
@@ -407,6 +532,10 @@ struct index_info {
   uint32_t average_page_length;
   std::vector<std::pair<std::string, uint32_t>> pages;
 
+  // Longest url path of all the pages, so scores from shards that
+  // only hold some of them are adjusted the same.
+  uint32_t url_max_len{0};
+
   std::map<uint32_t, std::string> word_parts;
   std::map<uint32_t, std::string> pair_parts;
   std::map<uint32_t, std::string> trine_parts;
@@ -415,14 +544,22 @@ struct index_info {
 
   void load();
   void save();
+
+  void set_url_max_len();
 };
 
 struct indexer {
   size_t splits, htcap;
+  bool positions;
 
   std::vector<std::pair<std::string, uint32_t>> pages;
   size_t pages_usage{0};
 
+  // Fingerprints of the pages in the part being built, by page id,
+  // so copies across sites are only indexed once. They go with the
+  // part, along with anything they left out.
+  fingerprint_index<uint32_t> fingerprints;
+
   std::vector<index_writer> word_t, pair_t, trine_t;
 
   uint8_t *file_buf{nullptr};
@@ -435,8 +572,10 @@ struct indexer {
       size_t splits,
       size_t htcap,
       size_t max_f,
-      size_t max_p)
+      size_t max_p,
+      bool positions = false)
     : splits(splits), htcap(htcap),
+      positions(positions),
       file_buf_size(max_f),
       out_buf_size(max_p)
   {
@@ -458,7 +597,8 @@ struct indexer {
       word_t.emplace_back(htcap, 2,
           1024 * 512,
           1024 * 128,
-          1024 * 256);
+          1024 * 256,
+          positions);
 
       pair_t.emplace_back(htcap, 2,
           1024 * 512,
@@ -485,6 +625,7 @@ struct indexer {
   void clear() {
     pages.clear();
     pages_usage = 0;
+    fingerprints.clear();
     for (auto &p: word_t) p.clear();
     for (auto &p: pair_t) p.clear();
     for (auto &p: trine_t) p.clear();
@@ -515,6 +656,7 @@ struct indexer {
 
     pa += pages.size() * 64;
     pa += pages_usage;
+    pa += fingerprints.blocks.size() * 64;
 
     size_t u = w + p + t + pa;
 
@@ -528,10 +670,11 @@ struct indexer {
     return u;
   }
 
-  void index_site(site_map &site, std::function<void()> before_page);
+  // Pages close to one already in the part are left out.
+  void index_site(site_view &site, std::function<void()> before_page);
 
   void insert(std::vector<index_writer> &t,
-      const std::string &s, uint32_t page_id);
+      const std::string &s, uint32_t page_id, uint32_t pos = 0);
 
   void insert(index_type t, const std::string &s, uint32_t page_id);
 
@@ -550,32 +693,66 @@ struct indexer {
   }
 };
 
+struct part_matches {
+  std::vector<std::vector<std::pair<std::string, double>>> postings;
+
+  // Only for terms in parts that have positions.
+  std::map<std::string, std::vector<positional_post>> positions;
+};
+
+// A query split into terms, with the terms grouped by the part
+// that holds them so each part is only loaded once.
+struct query_terms {
+  std::list<std::string> words;
+  std::list<std::string> pairs;
+  std::list<std::string> trines;
+
+  std::map<std::string, std::vector<std::string>> lookups;
+};
+
 struct searcher {
   index_info info;
   size_t max_part_size;
 
+  // A shard holds the pages with ids in [page_lo, page_hi), at
+  // info.pages[id - page_lo]. page_count is for the whole index.
+  size_t shard{0};
+  size_t shards{1};
+  size_t page_count{0};
+  uint32_t page_lo{0};
+  uint32_t page_hi{UINT32_MAX};
+
   searcher(std::string p, size_t max_part_size)
       : info(p), max_part_size(max_part_size) {}
 
-  void load() {
-    info.load();
-  }
+  void load(size_t shard = 0, size_t shards = 1);
 
-  void find_part_matches(index_reader &p,
-    const std::string &term,
-    std::vector<std::vector<std::pair<std::string, double>>> &postings);
+  part_matches find_part_matches(
+      const std::string &path,
+      const std::vector<std::string> &terms);
+
+  void find_phrase_matches(
+      std::list<std::string> &words,
+      std::map<std::string, std::vector<positional_post>> &positions,
+      std::vector<std::vector<std::pair<std::string, double>>> &postings);
 
   void find_matches(
     std::map<uint32_t, std::string> &parts,
     std::list<std::string> &terms,
-    std::vector<std::vector<std::pair<std::string, double>>> &postings);
+    std::map<std::string, std::vector<std::string>> &lookups);
+
+  query_terms find_terms(char *line);
 
-  std::vector<std::vector<std::pair<std::string, double>>>
-    find_matches(char *line);
+  // The parts are independent and only read info so they can be
+  // looked up on other threads, then merged here.
+  std::vector<std::vector<std::pair<std::string, double>>> merge_matches(
+      query_terms &terms,
+      std::vector<std::optional<part_matches>> &results);
 };
 
 std::list<std::pair<std::string, double>>
-intersect_postings(std::vector<std::vector<std::pair<std::string, double>>> &postings);
+intersect_postings(std::vector<std::vector<std::pair<std::string, double>>> &postings,
+    bool normalize = true, size_t url_max_len = 0);
 
 }
 
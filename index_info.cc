@@ -19,6 +19,7 @@
 
 #include "index.h"
 #include "tokenizer.h"
+#include "util.h"
 
 using namespace std::chrono_literals;
 
@@ -90,6 +91,7 @@ void index_info::save()
 {
   json j = json{
       {"average_page_length", average_page_length},
+      {"url_max_len", url_max_len},
       {"pages", pages},
       {"parts", parts},
       {"htcap", htcap},
@@ -133,6 +135,20 @@ void index_info::load()
   j.at("word_parts").get_to(word_parts);
   j.at("pair_parts").get_to(pair_parts);
   j.at("trine_parts").get_to(trine_parts);
+
+  if (j.contains("url_max_len")) {
+    j.at("url_max_len").get_to(url_max_len);
+  } else {
+    set_url_max_len();
+  }
+}
+
+void index_info::set_url_max_len()
+{
+  url_max_len = 0;
+  for (auto &p: pages) {
+    url_max_len = std::max(url_max_len, (uint32_t) util::get_path(p.first).length());
+  }
 }
 
 }
@@ -166,6 +166,21 @@ void index_manager::mark_indexable(const std::string &site_path) {
   have_changes = true;
 }
 
+// Same as marking each site but only goes over the parts once.
+void index_manager::mark_indexable(const std::vector<std::string> &site_paths) {
+  std::unordered_set<std::string> paths(site_paths.begin(), site_paths.end());
+
+  auto removed = pop_parts(paths);
+
+  for (auto ss: removed) {
+    sites_pending_index.emplace(ss);
+  }
+
+  sites_pending_index.insert(site_paths.begin(), site_paths.end());
+
+  have_changes = true;
+}
+
 void index_manager::index_failed(const std::vector<std::string> &sites) {
   for (auto &site: sites) {
     auto it = sites_indexing.find(site);
@@ -323,6 +338,8 @@ void index_manager::finish_merge() {
 
   info.parts = index_splits;
 
+  info.set_url_max_len();
+
   info.save();
 
   merge_out_w.clear();
@@ -376,3 +393,30 @@ std::vector<std::string> index_manager::pop_parts(const std::string &site_path)
   return removed_sites;
 }
 
+
+std::vector<std::string> index_manager::pop_parts(const std::unordered_set<std::string> &site_paths) {
+  std::vector<std::string> removed_sites;
+
+  auto part = index_parts.begin();
+
+  while (part != index_parts.end()) {
+    bool site_in_part = false;
+
+    for (auto &s: part->sites) {
+      if (site_paths.find(s) != site_paths.end()) {
+        site_in_part = true;
+        break;
+      }
+    }
+
+    if (site_in_part) {
+      removed_sites.insert(removed_sites.end(), part->sites.begin(), part->sites.end());
+
+      part = index_parts.erase(part);
+    } else {
+      part++;
+    }
+  }
+
+  return removed_sites;
+}
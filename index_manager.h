@@ -133,6 +133,7 @@ public:
   // indexing
 
   void mark_indexable(const std::string &site_path);
+  void mark_indexable(const std::vector<std::string> &site_paths);
   void index_failed(const std::vector<std::string> &sites);
 
   std::vector<std::string> get_sites_for_index(bool flush);
@@ -154,6 +155,7 @@ private:
   index_part * find_part(const std::string &path);
 
   std::vector<std::string> pop_parts(const std::string &site_path);
+  std::vector<std::string> pop_parts(const std::unordered_set<std::string> &site_paths);
 };
 
 
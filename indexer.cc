@@ -19,6 +19,8 @@
 
 #include "index.h"
 #include "tokenizer.h"
+#include "site_view.h"
+#include "archive.h"
 
 using namespace std::chrono_literals;
 
@@ -41,8 +43,15 @@ static bool word_allow_extra(std::string s)
   return true;
 }
 
-void indexer::index_site(site_map &site, std::function<void()> before_page) {
-  spdlog::info("index site {}", site.host);
+void indexer::index_site(site_view &site, std::function<void()> before_page) {
+  if (!site.ok()) {
+    spdlog::warn("could not read site {}", site.path);
+    return;
+  }
+
+  std::string host = site.site.getHost();
+
+  spdlog::info("index site {}", host);
 
   const size_t buf_len = 80;
 
@@ -60,39 +69,78 @@ void indexer::index_site(site_map &site, std::function<void()> before_page) {
 
 	tokenizer::token_type token;
 
-  spdlog::info("process {} pages for {}", site.pages.size(), site.host);
-  for (auto &page: site.pages) {
-    if (page.last_scanned == 0) {
-      spdlog::debug("skip unscanned page {}", page.url);
+  auto site_pages = site.site.getPages();
+
+  archive::reader segments;
+
+  spdlog::info("process {} pages for {}", site_pages.size(), host);
+  for (auto page: site_pages) {
+    std::string url = page.getUrl();
+    std::string path = page.getPath();
+
+    if (page.getLastScanned() == 0) {
+      spdlog::debug("skip unscanned page {}", url);
       continue;
     }
 
     before_page();
 
+    // After before_page as that may start a new part.
+    uint64_t fingerprint = page.getFingerprint();
+    if (fingerprint != 0) {
+      auto original = fingerprints.find(fingerprint);
+      if (original) {
+        spdlog::debug("skip {}, a copy of {}", url, pages[*original].first);
+        continue;
+      }
+    }
+
     size_t page_length = 0;
 
-    std::ifstream pfile;
+    size_t len;
 
-    pfile.open(page.path, std::ios::in | std::ios::binary);
+    if (page.getArchiveSize() > 0) {
+      ssize_t r = segments.read(path,
+          page.getArchiveOffset(), page.getArchiveSize(),
+          (uint8_t *) file_buf, file_buf_size);
 
-    if (!pfile.is_open() || pfile.fail() || !pfile.good() || pfile.bad()) {
-      spdlog::warn("error opening file {}", page.path);
-      continue;
-    }
+      if (r < 0) {
+        spdlog::warn("error reading {} from {}", url, path);
+        continue;
+      }
+
+      len = r;
+
+    } else {
+      std::ifstream pfile;
+
+      pfile.open(path, std::ios::in | std::ios::binary);
 
-    pfile.read((char *) file_buf, file_buf_size);
+      if (!pfile.is_open() || pfile.fail() || !pfile.good() || pfile.bad()) {
+        spdlog::warn("error opening file {}", path);
+        continue;
+      }
 
-    size_t len = pfile.gcount();
+      pfile.read((char *) file_buf, file_buf_size);
 
-    uint32_t page_id = add_page(page.url);
+      len = pfile.gcount();
+    }
+
+    uint32_t page_id = add_page(url);
+
+    if (fingerprint != 0) {
+      fingerprints.add(fingerprint, page_id);
+    }
 
     spdlog::trace("process page {} kb : {}",
-      len / 1024, page.url);
+      len / 1024, url);
 
     tokenizer::tokenizer tok((char *) file_buf, len);
 
     bool in_head = false, in_title = false;
 
+    uint32_t pos = 0;
+
     str_resize(&tok_buffer_pair, 0);
     str_resize(&tok_buffer_trine, 0);
 
@@ -122,6 +170,9 @@ void indexer::index_site(site_map &site, std::function<void()> before_page) {
         if (t != "a" && t != "strong") {
           str_resize(&tok_buffer_pair, 0);
           str_resize(&tok_buffer_trine, 0);
+
+          // Leave a gap so phrases don't match across tags.
+          pos++;
         }
 
       } else if ((in_title || !in_head) && token == tokenizer::WORD) {
@@ -132,7 +183,12 @@ void indexer::index_site(site_map &site, std::function<void()> before_page) {
 
         page_length++;
 
-        insert(word_t, s, page_id);
+        insert(word_t, s, page_id, pos++);
+
+        // Phrases come from the word positions instead.
+        if (positions) {
+          continue;
+        }
 
         if (word_allow_extra(s)) {
           if (str_length(&tok_buffer_trine) > 0) {
@@ -167,12 +223,10 @@ void indexer::index_site(site_map &site, std::function<void()> before_page) {
       }
     } while (token != tokenizer::END);
 
-    pfile.close();
-
-    set_page_size(page.url, page_length);
+    set_page_size(url, page_length);
   }
 
-  spdlog::debug("finished indexing site {}", site.host);
+  spdlog::debug("finished indexing site {}", host);
 }
 
 std::map<uint32_t, std::string>
@@ -209,8 +263,11 @@ std::string indexer::save(const std::string &base_path)
   index_info info(meta_path);
 
   info.word_parts = save_parts(word_t, words_path, out_buf, out_buf_size);
-  info.pair_parts = save_parts(pair_t, pairs_path, out_buf, out_buf_size);
-  info.trine_parts = save_parts(trine_t, trines_path, out_buf, out_buf_size);
+
+  if (!positions) {
+    info.pair_parts = save_parts(pair_t, pairs_path, out_buf, out_buf_size);
+    info.trine_parts = save_parts(trine_t, trines_path, out_buf, out_buf_size);
+  }
 
   info.htcap = htcap;
   info.parts = splits;
@@ -229,6 +286,7 @@ std::string indexer::save(const std::string &base_path)
   }
 
   info.average_page_length = average_page_length;
+  info.set_url_max_len();
 
   info.save();
 
@@ -236,11 +294,11 @@ std::string indexer::save(const std::string &base_path)
 }
 
 void indexer::insert(std::vector<index_writer> &t,
-      const std::string &s, uint32_t page_id)
+      const std::string &s, uint32_t page_id, uint32_t pos)
 {
 	size_t h = part_split(s, splits);
 
-  return t[h].insert(s, page_id);
+  return t[h].insert(s, page_id, pos);
 }
 
 }
@@ -24,6 +24,7 @@
 #include "util.h"
 #include "config.h"
 #include "site.h"
+#include "site_view.h"
 #include "tokenizer.h"
 #include "index.h"
 
@@ -61,7 +62,8 @@ public:
         settings.index_parts,
         settings.indexer.htcap,
         settings.crawler.max_page_size,
-        settings.indexer.max_index_part_size);
+        settings.indexer.max_index_part_size,
+        settings.indexer.positions);
 
     spdlog::info("indexer created");
 
@@ -94,10 +96,9 @@ public:
         auto &n = outputs.emplace_back();
       }
 
-      site_map site(path);
-      site.load();
+      site_view site(path);
 
-      spdlog::info("index {}", site.host);
+      spdlog::info("index {}", std::string(path));
       indexer.index_site(site, 
         [max_usage, &base_path, &path, &flush_count, &indexer, &outputs] () mutable {
           if (indexer.usage() > max_usage) {
@@ -115,7 +116,7 @@ public:
       auto &o = outputs.back();
       o.sites.emplace_back(path);
 
-      spdlog::info("done  {}", site.host);
+      spdlog::info("done  {}", std::string(path));
     }
 
     auto &o = outputs.back();
@@ -0,0 +1,71 @@
+#ifndef LOOP_THREAD_H
+#define LOOP_THREAD_H
+
+#include <vector>
+
+#include <kj/async.h>
+#include <kj/thread.h>
+#include <kj/mutex.h>
+
+// A thread running its own kj event loop. Work handed to run is
+// done on the thread and the result comes back as a promise on
+// the loop that called run.
+class loop_thread {
+  kj::MutexGuarded<const kj::Executor *> executor_slot{nullptr};
+  const kj::Executor *executor{nullptr};
+
+  // Only touched from the thread.
+  kj::Own<kj::PromiseFulfiller<void>> stop;
+
+  kj::Thread thread;
+
+public:
+  loop_thread()
+    : thread([this] () {
+        kj::EventLoop loop;
+        kj::WaitScope scope(loop);
+
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        stop = kj::mv(paf.fulfiller);
+
+        *executor_slot.lockExclusive() = &kj::getCurrentThreadExecutor();
+
+        paf.promise.wait(scope);
+      })
+  {
+    executor = executor_slot.when(
+        [] (const kj::Executor *e) { return e != nullptr; },
+        [] (const kj::Executor *e) { return e; });
+  }
+
+  ~loop_thread() {
+    executor->executeSync([this] () {
+        stop->fulfill();
+      });
+  }
+
+  template <typename F>
+  auto run(F &&f) {
+    return executor->executeAsync(kj::fwd<F>(f));
+  }
+};
+
+// Threads for work that would otherwise block the caller's loop.
+class worker_pool {
+  std::vector<kj::Own<loop_thread>> workers;
+  size_t next{0};
+
+public:
+  worker_pool(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      workers.push_back(kj::heap<loop_thread>());
+    }
+  }
+
+  template <typename F>
+  auto run(F &&f) {
+    return workers[next++ % workers.size()]->run(kj::fwd<F>(f));
+  }
+};
+
+#endif
@@ -26,6 +26,7 @@
 #include "index.h"
 #include "index_manager.h"
 #include "capnp_server.h"
+#include "loop_thread.h"
 
 #include "indexer.capnp.h"
 
@@ -34,6 +35,7 @@
 #include <kj/async-unix.h>
 #include <kj/timer.h>
 #include <kj/threadlocal.h>
+#include <kj/vector.h>
 #include <capnp/ez-rpc.h>
 #include <capnp/rpc-twoparty.h>
 #include <capnp/capability.h>
@@ -43,6 +45,74 @@
 
 using nlohmann::json;
 
+// The crawl state for the hosts that hash to one shard. The
+// crawler is only touched from the shard's own thread, the master
+// hands it work with run.
+struct crawl_shard {
+  crawl::crawler crawler;
+
+  bool have_changes{false};
+
+  // Declared last so the thread is stopped before the crawler
+  // goes.
+  loop_thread thread;
+
+  crawl_shard(const config &c, size_t i, size_t n)
+    : crawler(c, i, n)
+  {}
+
+  template <typename F>
+  auto run(F &&f) {
+    return thread.run(kj::fwd<F>(f));
+  }
+
+  void flush() {
+    if (have_changes) {
+      spdlog::info("shard {} save: flush {} sites",
+          crawler.shard, crawler.loaded_sites.sites.size());
+      crawler.loaded_sites.flush();
+
+      crawler.save();
+
+      have_changes = false;
+    } else {
+      crawler.loaded_sites.evict();
+    }
+
+    auto &cache = crawler.loaded_sites;
+    spdlog::info("shard {} site cache: {} sites using {} mb, {} hits, {} misses, {} evictions",
+        crawler.shard, cache.sites.size(), cache.usage() / 1024 / 1024,
+        cache.hits, cache.misses, cache.evictions);
+  }
+};
+
+// A registered crawler and how many sites it can take.
+struct crawler_client {
+  Crawler::Client client;
+
+  size_t slots;
+  size_t active{0};
+
+  bool dead{false};
+
+  crawler_client(Crawler::Client c, size_t s)
+    : client(kj::mv(c)), slots(s)
+  {}
+};
+
+// A site taken from a shard's frontier. The pointer is only
+// followed on the shard.
+struct crawl_job {
+  crawl::site *site;
+
+  std::string host;
+  std::string path;
+  std::string data_path;
+
+  size_t level;
+  size_t max_pages;
+};
+
 class MasterImpl final: public Master::Server,
                         public kj::TaskSet::ErrorHandler {
 
@@ -51,95 +121,79 @@ class MasterImpl final: public Master::Server,
     : settings(s), tasks(*this),
       timer(io_context.provider->getTimer()),
       indexer(s.index_meta_path, s.indexer.sites_per_part, s.index_parts, s.merger.meta_path),
-      crawler(s)
+      expanders(std::max(1u, std::thread::hardware_concurrency() / 2))
   {
+    for (size_t i = 0; i < s.crawler.shards; i++) {
+      shards.push_back(kj::heap<crawl_shard>(s, i, s.crawler.shards));
+    }
+
     tasks.add(timer.afterDelay(1 * kj::SECONDS).then(
       [this] () {
         setup();
       }));
   }
 
-  void setup() {
-    spdlog::info("load crawler");
-    crawler.load();
+  crawl_shard &shard_for(const std::string &host) {
+    return *shards[crawl::shard_of(host, shards.size())];
+  }
 
+  void setup() {
     std::vector<std::string> blacklist = util::load_list(settings.blacklist_path);
     std::vector<std::string> initial_seed = util::load_list(settings.seed_path);
 
-    spdlog::info("load blacklist");
+    std::vector<std::vector<std::string>> seeds(shards.size());
+    for (auto &url: initial_seed) {
+      seeds[crawl::shard_of(util::get_host(url), shards.size())].push_back(url);
+    }
 
-    crawler.load_blacklist(blacklist);
-    spdlog::info("load seed");
-    crawler.load_seed(initial_seed);
+    spdlog::info("load {} crawler shards", shards.size());
 
-    spdlog::info("load indexing state");
-//    indexer.load();
+    auto loading = kj::heapArrayBuilder<kj::Promise<std::vector<std::string>>>(shards.size());
 
-    spdlog::info("mark all sites indexable");
-    size_t i = 0;
-    for (auto &site: crawler.sites) {
-      if (site.scraped)
-        indexer.mark_indexable(site.path);
+    for (size_t i = 0; i < shards.size(); i++) {
+      auto &shard = *shards[i];
 
-      if (++i % 100000 == 0) {
-        spdlog::debug("marked {}", i);
+      loading.add(shard.run(
+          [&shard, blacklist, seed = std::move(seeds[i])] () mutable {
+            auto &crawler = shard.crawler;
 
-        indexer.save();
-      }
-    }
+            crawler.load();
+            crawler.load_blacklist(blacklist);
+            crawler.load_seed(seed);
 
-    spdlog::info("initial flush");
-    flush();
+            std::vector<std::string> scraped;
+            for (auto &site: crawler.sites) {
+              if (site.scraped)
+                scraped.push_back(site.path);
+            }
 
-    spdlog::info("start crawling");
-    checkCrawlers();
-    spdlog::info("start indexing");
-    indexNext();
-    spdlog::info("start merging");
-    mergeNext();
+            return scraped;
+          }));
+    }
 
-    spdlog::info("setup done");
-  }
+    tasks.add(kj::joinPromises(loading.finish()).then(
+        [this] (auto shard_scraped) {
+          spdlog::info("mark all sites indexable");
 
-  void checkCrawlers() {
-    for (auto &c: crawlers) {
-      auto request = c.canCrawlRequest();
+          std::vector<std::string> scraped;
+          for (auto &s: shard_scraped) {
+            scraped.insert(scraped.end(), s.begin(), s.end());
+          }
 
-      auto it = std::find(ready_crawlers.begin(), ready_crawlers.end(), &c);
-      if (it != ready_crawlers.end()) {
-        continue;
-      }
+          indexer.mark_indexable(scraped);
 
-      tasks.add(request.send().then(
-        [this, &c] (auto result) {
+          spdlog::info("initial flush");
+          flush();
 
-          bool can_crawl = result.getHaveSpace();
+          spdlog::info("start crawling");
+          crawlNext();
+          spdlog::info("start indexing");
+          indexNext();
+          spdlog::info("start merging");
+          mergeNext();
 
-          if (can_crawl) {
-            auto it = std::find(ready_crawlers.begin(), ready_crawlers.end(), &c);
-            if (it == ready_crawlers.end()) {
-              ready_crawlers.push_back(&c);
-              crawlNext();
-            }
-          }
-        },
-        [this, &c] (auto exception) {
-          spdlog::warn("crawler {} error checking can crawl, removing", (uintptr_t) &c);
-
-          ready_crawlers.remove(&c);
-/*
-          crawlers.remove_if(
-              [&c] (auto cc) {
-                return &cc == &c;
-              });
-              */
+          spdlog::info("setup done");
         }));
-    }
-
-    tasks.add(timer.afterDelay(1 * kj::SECONDS).then(
-          [this] () {
-            checkCrawlers();
-          }));
   }
 
   void flush() {
@@ -147,50 +201,117 @@ class MasterImpl final: public Master::Server,
 
     indexer.save();
 
-    if (have_changes) {
-      spdlog::info("periodic save: started");
-
-      spdlog::info("periodic save: flush sites");
-      for (auto &s: crawler.sites) {
-        s.flush();
-      }
-
-      spdlog::info("periodic save: save metadata");
-      crawler.save();
-
-      spdlog::info("periodic save: finished");
-
-      have_changes = false;
+    // Each shard saves its own sites on its own thread.
+    for (auto &s: shards) {
+      auto &shard = *s;
+      tasks.add(shard.run(
+          [&shard] () {
+            shard.flush();
+          }));
     }
 
+    // Sites waiting out a retry are only picked up when something
+    // asks for them.
+    sitesChanged();
+
     tasks.add(timer.afterDelay(60 * kj::SECONDS).then(
           [this] () {
             flush();
           }));
   }
 
-  void crawlNext() {
-    if (ready_crawlers.empty()) {
+  // Anything that could have made a site ready to crawl calls
+  // this so idle crawlers get work straight away.
+  void sitesChanged() {
+    sites_gen++;
+    no_sites = false;
+
+    crawlNext();
+  }
+
+  void readyCrawler(crawler_client *c) {
+    if (c->dead || c->active >= c->slots) {
       return;
     }
 
-    auto site = crawler.get_next_site();
-    if (site == nullptr) {
+    auto it = std::find(ready_crawlers.begin(), ready_crawlers.end(), c);
+    if (it == ready_crawlers.end()) {
+      ready_crawlers.push_back(c);
+    }
+  }
+
+  // Hands a site to each free crawler slot, taking turns between
+  // crawlers.
+  void crawlNext() {
+    while (!no_sites && !ready_crawlers.empty()) {
+      auto c = ready_crawlers.front();
+      ready_crawlers.pop_front();
+
+      if (c->dead || c->active >= c->slots) {
+        continue;
+      }
+
+      c->active++;
+      readyCrawler(c);
+
+      takeSite(c, 0, sites_gen);
+    }
+  }
+
+  // Ask the shards in turn for a site, the slot is given back if
+  // none of them have one.
+  void takeSite(crawler_client *c, size_t tries, uint64_t gen) {
+    if (tries == shards.size()) {
       spdlog::info("no sites to crawl");
+
+      // Unless sites changed while asking, stop asking until they
+      // do.
+      if (gen == sites_gen) {
+        no_sites = true;
+      }
+
+      c->active--;
+      readyCrawler(c);
+
+      crawlNext();
+
       return;
     }
 
-    site->flush();
+    auto &shard = *shards[next_shard++ % shards.size()];
+
+    tasks.add(shard.run(
+        [&shard] () -> std::optional<crawl_job> {
+          auto &crawler = shard.crawler;
+
+          auto site = crawler.get_next_site();
+          if (site == nullptr) {
+            return std::nullopt;
+          }
 
-    auto proc = ready_crawlers.front();
-    ready_crawlers.pop_front();
+          site->flush();
+          site->scraping = true;
+
+          return crawl_job{site, site->host, site->path,
+            crawler.get_data_path(site->host),
+            site->level, site->max_pages};
+        }).then(
+        [this, &shard, c, tries, gen] (auto job) {
+          if (job) {
+            crawlSite(shard, c, *job);
+          } else {
+            takeSite(c, tries + 1, gen);
+          }
+        }));
+  }
 
-    auto request = proc->crawlRequest();
+  void crawlSite(crawl_shard &shard, crawler_client *c, const crawl_job &job) {
+    auto request = c->client.crawlRequest();
 
-    request.setSitePath(site->path);
-    request.setDataPath(crawler.get_data_path(site->host));
+    request.setSitePath(job.path);
+    request.setDataPath(job.data_path);
 
-    request.setMaxPages(site->max_pages);
+    request.setMaxPages(job.max_pages);
 
     /*
     request.setMaxConnections(settings.crawler.site_max_connections);
@@ -198,63 +319,166 @@ class MasterImpl final: public Master::Server,
     request.setMaxPartSize(settings.crawler.max_site_part_size);
     */
 
-    site->scraping = true;
-
-    spdlog::info("start crawling {}", site->host);
+    spdlog::info("start crawling {}", job.host);
 
     tasks.add(request.send().then(
-        [this, site, proc] (auto result) {
-          spdlog::info("got response for crawl site {}", site->host);
+        [this, &shard, c, job] (auto result) {
+          spdlog::info("got response for crawl site {}", job.host);
 
-          site->reload();
+          c->active--;
 
-          size_t max_add_sites = 0;
-          size_t next_max_pages = 0;
+          // What the crawler says is free plus what is still on its
+          // way to it or running there.
+          c->slots = result.getFreeSlots() + c->active;
 
-          if (site->level + 1 < crawler.levels.size()) {
-            auto level = crawler.levels[site->level];
-            auto next_level = crawler.levels[site->level + 1];
+          readyCrawler(c);
 
-            max_add_sites = level.max_add_sites;
-            next_max_pages = next_level.max_pages;
+          expandSite(shard, job, result.getChangedPages() > 0);
+
+          crawlNext();
+        },
+        [this, &shard, c, job] (auto exception) {
+          spdlog::warn("got exception for crawl site {} : {}",
+              job.host, std::string(exception.getDescription()));
+
+          c->active--;
+
+          if (exception.getType() == kj::Exception::Type::DISCONNECTED) {
+            spdlog::warn("crawler {} disconnected, removing", (uintptr_t) c);
+            c->dead = true;
+            ready_crawlers.remove(c);
+          } else {
+            readyCrawler(c);
           }
 
-          crawler.expand(site, max_add_sites, next_max_pages);
+          tasks.add(shard.run(
+              [&shard, site = job.site] () {
+                site->scraping = false;
+                shard.crawler.crawl_failed(site);
+              }).then(
+              [this] () {
+                crawlNext();
+              }));
+        }));
+  }
 
-          site->last_scanned = time(NULL);
+  // Work out the links to other sites on a worker then add them
+  // to whichever shards own the hosts. The site stays marked as
+  // scraping until then so it is not handed out again.
+  void expandSite(crawl_shard &shard, const crawl_job &job, bool changed) {
+    auto &levels = settings.crawler.levels;
 
-          size_t page_count = site->pages.size();
-          spdlog::debug("saving scraped site with {} pages", page_count);
+    size_t max_add_sites = 0;
+    size_t next_max_pages = 0;
 
-          // Need to write the changes for this site
-          // so the indexer has something to load.
+    if (job.level + 1 < levels.size()) {
+      max_add_sites = levels[job.level].max_add_sites;
+      next_max_pages = levels[job.level + 1].max_pages;
+    }
+
+    // The crawler has rewritten the site, drop anything loaded.
+    auto expanding = shard.run(
+        [site = job.site] () {
+          site->changed = false;
           site->flush();
+        }).then(
+        [this, &shard, job, max_add_sites] () {
+          return expanders.run(
+              [&crawler = shard.crawler, path = job.path, host = job.host, max_add_sites] () {
+                return crawler.find_expansion(path, host, max_add_sites);
+              });
+        }).then(
+        [this, job, next_max_pages] (auto e) {
+          size_t page_count = e.page_count;
 
-          site->max_pages = 0;
-          site->scraped = true;
-          site->scraping = false;
+          return spreadExpansion(job, e, next_max_pages).then(
+              [page_count] () {
+                return std::optional<size_t>(page_count);
+              });
+        });
+
+    tasks.add(expanding.then(
+        [this, &shard, job, changed] (auto page_count) {
+          finishSite(shard, job, page_count, changed);
+        },
+        [this, &shard, job, changed] (auto exception) {
+          spdlog::warn("failed to expand {} : {}",
+              job.host, std::string(exception.getDescription()));
+
+          finishSite(shard, job, std::nullopt, changed);
+        }));
+  }
+
+  kj::Promise<void> spreadExpansion(const crawl_job &job,
+      crawl::expansion &e, size_t next_max_pages)
+  {
+    std::vector<std::vector<std::pair<std::string, std::vector<std::string>>>>
+      by_shard(shards.size());
+
+    for (auto &h: e.hosts) {
+      by_shard[crawl::shard_of(h.first, shards.size())].push_back(std::move(h));
+    }
+
+    kj::Vector<kj::Promise<void>> adding;
+
+    for (size_t i = 0; i < shards.size(); i++) {
+      if (by_shard[i].empty()) continue;
 
-          have_changes = true;
+      auto &shard = *shards[i];
 
-          indexer.mark_indexable(site->path);
+      adding.add(shard.run(
+          [&shard, hosts = std::move(by_shard[i]),
+           level = job.level + 1, next_max_pages] () {
+            for (auto &h: hosts) {
+              shard.crawler.add_links(h.first, h.second, level, next_max_pages);
+            }
+
+            shard.have_changes = true;
 
-          auto it = std::find(ready_crawlers.begin(), ready_crawlers.end(), proc);
-          if (it == ready_crawlers.end()) {
-            ready_crawlers.push_back(proc);
+            // Expanding can load a lot of other sites.
+            shard.crawler.loaded_sites.evict();
+          }));
+    }
+
+    spdlog::info("expand {} to {} hosts on {} shards",
+        job.host, e.hosts.size(), adding.size());
+
+    return kj::joinPromises(adding.releaseAsArray());
+  }
+
+  // Sites where nothing changed have nothing new to index.
+  void finishSite(crawl_shard &shard, const crawl_job &job,
+      std::optional<size_t> page_count, bool changed)
+  {
+    tasks.add(shard.run(
+        [&shard, site = job.site, page_count] () {
+          auto &crawler = shard.crawler;
+
+          site->last_scanned = time(NULL);
+          if (page_count) {
+            site->page_count = *page_count;
           }
 
-          crawlNext();
-        },
-        [this, site, proc] (auto exception) {
-          spdlog::warn("got exception for crawl site {} : {}",
-              site->host, std::string(exception.getDescription()));
+          spdlog::debug("scraped site {} with {} pages", site->host, site->page_count);
 
+          site->max_pages = 0;
+          site->scraped = true;
           site->scraping = false;
 
-          crawlNext();
-        }));
+          crawler.crawl_succeeded(site);
+          crawler.mark_dirty(site);
 
-    crawlNext();
+          shard.have_changes = true;
+        }).then(
+        [this, path = job.path, changed] () {
+          if (changed) {
+            indexer.mark_indexable(path);
+          } else {
+            spdlog::info("{} unchanged, not reindexing", path);
+          }
+
+          sitesChanged();
+        }));
   }
 
   void mergeNext() {
@@ -413,11 +637,16 @@ class MasterImpl final: public Master::Server,
   }
 
   kj::Promise<void> registerCrawler(RegisterCrawlerContext context) override {
-    spdlog::debug("got register crawler");
+    auto params = context.getParams();
 
-    crawlers.push_back(context.getParams().getCrawler());
+    // Crawlers from before slots were sent take one site at a time.
+    size_t slots = std::max(params.getSlots(), (uint32_t) 1);
 
-    ready_crawlers.push_back(&crawlers.back());
+    spdlog::debug("got register crawler with {} slots", slots);
+
+    auto &c = crawlers.emplace_back(params.getCrawler(), slots);
+
+    readyCrawler(&c);
 
     crawlNext();
 
@@ -458,29 +687,51 @@ class MasterImpl final: public Master::Server,
 
     auto request = scorer.scoreRequest();
 
-    std::vector<crawl::site *> sites;
+    auto seed = request.initSeed(initial_seed.size());
 
-    for (auto &s: crawler.sites) {
-      //if (s.merged) {
-      if (s.scraped) {
-        sites.push_back(&s);
-      }
+    for (size_t i = 0; i < initial_seed.size(); i++) {
+      seed.set(i, initial_seed[i]);
     }
 
-    auto paths = request.initSitePaths(sites.size());
+    auto listing = kj::heapArrayBuilder<kj::Promise<std::vector<std::string>>>(shards.size());
 
-    for (size_t i = 0; i < sites.size(); i++) {
-      paths.set(i, sites[i]->path);
-    }
+    for (auto &s: shards) {
+      auto &shard = *s;
 
-    auto seed = request.initSeed(initial_seed.size());
+      listing.add(shard.run(
+          [&shard] () {
+            std::vector<std::string> paths;
 
-    for (size_t i = 0; i < initial_seed.size(); i++) {
-      seed.set(i, initial_seed[i]);
+            for (auto &s: shard.crawler.sites) {
+              //if (s.merged) {
+              if (s.scraped) {
+                paths.push_back(s.path);
+              }
+            }
+
+            return paths;
+          }));
     }
 
-    tasks.add(request.send().then(
-          [] (auto result) {
+    tasks.add(kj::joinPromises(listing.finish()).then(
+          [request = kj::mv(request)] (auto shard_paths) mutable {
+            size_t n = 0;
+            for (auto &p: shard_paths) {
+              n += p.size();
+            }
+
+            auto paths = request.initSitePaths(n);
+
+            size_t i = 0;
+            for (auto &p: shard_paths) {
+              for (auto &path: p) {
+                paths.set(i++, path);
+              }
+            }
+
+            return request.send().ignoreResult();
+          }).then(
+          [] () {
             spdlog::info("scoring finished");
           },
           [] (auto exception) {
@@ -491,9 +742,27 @@ class MasterImpl final: public Master::Server,
   }
 
   kj::Promise<void> registerSearcher(RegisterSearcherContext context) override {
-    spdlog::debug("got register searcher");
+    auto params = context.getParams();
+
+    uint32_t shard = params.getShard();
+
+    spdlog::debug("got register searcher for shard {}", shard);
+
+    // A restarted shard replaces the old one.
+    searchers.insert_or_assign(shard, params.getSearcher());
 
-    searchers.push_back(context.getParams().getSearcher());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> getSearchers(GetSearchersContext context) override {
+    spdlog::debug("get searchers");
+
+    auto results = context.getResults().initSearchers(searchers.size());
+
+    size_t i = 0;
+    for (auto &s: searchers) {
+      results.set(i++, s.second);
+    }
 
     return kj::READY_NOW;
   }
@@ -540,37 +809,57 @@ class MasterImpl final: public Master::Server,
 
     auto host = util::get_host(url);
 
-    auto site = crawler.find_site(host);
-    if (site == nullptr) {
-      spdlog::info("unknown site {}", host);
-      return kj::READY_NOW;
-    }
+    auto &shard = shard_for(host);
 
-    auto page = site->find_page(url);
-    if (page == nullptr) {
-      spdlog::info("have site {} but not page {}", host, url);
-      return kj::READY_NOW;
-    }
+    // Searches can touch a lot of sites, the page is copied out
+    // before evicting.
+    auto lookup = shard.run(
+        [&shard, host, url] () -> std::optional<std::pair<std::string, std::string>> {
+          auto &crawler = shard.crawler;
 
-    if (page->last_scanned == 0) {
-      spdlog::info("page not scraped {} : {} {} {} {}", url, page->last_scanned, page->url, page->title, page->path);
-      return kj::READY_NOW;
-    }
+          auto site = crawler.find_site(host);
+          if (site == nullptr) {
+            spdlog::info("unknown site {}", host);
+            return std::nullopt;
+          }
 
-    spdlog::info("have page {} : {} {} {} {}", url, page->last_scanned, page->url, page->title, page->path);
+          KJ_DEFER(crawler.loaded_sites.evict());
 
-    auto results = context.getResults();
+          auto page = site->find_page(url);
+          if (page == nullptr) {
+            spdlog::info("have site {} but not page {}", host, url);
+            return std::nullopt;
+          }
 
-    results.setTitle(page->title);
-    results.setPath(page->path);
+          if (page->last_scanned == 0) {
+            spdlog::info("page not scraped {} : {} {} {} {}", url, page->last_scanned, page->url, page->title, page->path);
+            return std::nullopt;
+          }
 
-    return getScore(url).then(
-        [this, url, KJ_CPCAP(context), KJ_CPCAP(results)] (auto score) mutable {
-          spdlog::info("got score for page {} {}", score, url);
-          results.setScore(score);
-        },
-        [this] (auto exception) {
-          spdlog::warn("get score failed: {}", std::string(exception.getDescription()));
+          spdlog::info("have page {} : {} {} {} {}", url, page->last_scanned, page->url, page->title, page->path);
+
+          return std::make_pair(page->title, page->path);
+        });
+
+    return lookup.then(
+        [this, url, KJ_CPCAP(context)] (auto info) mutable -> kj::Promise<void> {
+          if (!info) {
+            return kj::READY_NOW;
+          }
+
+          auto results = context.getResults();
+
+          results.setTitle(info->first);
+          results.setPath(info->second);
+
+          return getScore(url).then(
+              [this, url, KJ_CPCAP(results)] (auto score) mutable {
+                spdlog::info("got score for page {} {}", score, url);
+                results.setScore(score);
+              },
+              [this] (auto exception) {
+                spdlog::warn("get score failed: {}", std::string(exception.getDescription()));
+              });
         });
   }
 
@@ -581,18 +870,26 @@ class MasterImpl final: public Master::Server,
 
   const config &settings;
 
-  bool have_changes{false};
-
   kj::TaskSet tasks;
 
   kj::Timer &timer;
 
   // Crawling
 
-  crawl::crawler crawler;
+  std::vector<kj::Own<crawl_shard>> shards;
+  size_t next_shard{0};
+
+  worker_pool expanders;
+
+  std::list<crawler_client> crawlers;
+
+  // Crawlers with a free slot.
+  std::list<crawler_client *> ready_crawlers;
 
-  std::list<Crawler::Client> crawlers;
-  std::list<Crawler::Client *> ready_crawlers;
+  // Bumped whenever a site may have become ready, a search for a
+  // site that comes up empty only counts if nothing changed.
+  uint64_t sites_gen{0};
+  bool no_sites{false};
 
   // Indexing
 
@@ -616,7 +913,7 @@ class MasterImpl final: public Master::Server,
 
   // Searching
 
-  std::list<Searcher::Client> searchers;
+  std::map<uint32_t, Searcher::Client> searchers;
 };
 
 int main(int argc, char *argv[]) {
@@ -79,10 +79,14 @@ public:
 
     size_t htcap = settings.merger.htcap;
 
+    bool positions = settings.indexer.positions
+        && index_type == search::index_type::words;
+
     search::index_writer out(htcap, 56,
           1024 * 1024 * 50,
           1024 * 1024 * 10,
-          1024 * 1024 * 100);
+          1024 * 1024 * 100,
+          positions);
 
     uint32_t page_id_offset = 0;
 
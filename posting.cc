@@ -11,14 +11,14 @@ using namespace std::chrono_literals;
 
 namespace search {
 
-std::vector<post> posting_reader::decompress(read_backing &p)
+std::vector<post> posting_reader::decompress(read_backing &p,
+    uint32_t lo, uint32_t hi, uint32_t o, uint32_t prev_id)
 {
   uint8_t *b = p.get_data(offset);
 
   std::vector<post> posts;
 
-  uint32_t id, prev_id = 0;
-  uint32_t o = 0;
+  uint32_t id;
 
   while (o < len) {
     o += vbyte_read(&b[o], &id);
@@ -28,13 +28,58 @@ std::vector<post> posting_reader::decompress(read_backing &p)
     uint8_t count = b[o];
     o++;
 
-    posts.emplace_back(id, count);
+    // Ids only go up.
+    if (id >= hi) {
+      break;
+    }
+
+    if (id >= lo) {
+      posts.emplace_back(id, count);
+    }
   }
 
   return posts;
 }
 
-uint8_t * posting_writer::ensure_size(write_backing &p, uint32_t need)
+// Each doc's positions are vbyte deltas from the last with the
+// first stored as pos + 1, so a 0 can seperate the docs.
+std::vector<std::vector<uint32_t>> position_reader::decompress(read_backing &p, size_t docs,
+    uint32_t o)
+{
+  std::vector<std::vector<uint32_t>> positions(1);
+
+  uint8_t *b = p.get_data(offset);
+
+  uint32_t v, pos = 0;
+
+  while (o < len) {
+    o += vbyte_read(&b[o], &v);
+
+    auto &doc = positions.back();
+
+    if (v == 0) {
+      if (positions.size() == docs) {
+        break;
+      }
+
+      positions.emplace_back();
+    } else if (doc.empty()) {
+      pos = v - 1;
+      doc.push_back(pos);
+    } else {
+      pos += v;
+      doc.push_back(pos);
+    }
+  }
+
+  positions.resize(docs);
+
+  return positions;
+}
+
+static uint8_t * grow(write_backing &p,
+    uint32_t &offset, uint32_t len, uint32_t &max_len,
+    uint32_t need)
 {
   if (need < max_len) {
     return p.get_data(offset);
@@ -64,6 +109,16 @@ uint8_t * posting_writer::ensure_size(write_backing &p, uint32_t need)
   return b.buf;
 }
 
+uint8_t * posting_writer::ensure_size(write_backing &p, uint32_t need)
+{
+  return grow(p, offset, len, max_len, need);
+}
+
+uint8_t * posting_writer::ensure_pos_size(write_backing &p, uint32_t need)
+{
+  return grow(p, pos_offset, pos_len, pos_max_len, need);
+}
+
 void posting_writer::append(write_backing &p, uint32_t id, uint8_t count)
 {
   if (id == last_id && len > 0) {
@@ -84,7 +139,55 @@ void posting_writer::append(write_backing &p, uint32_t id, uint8_t count)
   last_id = id;
 }
 
-void posting_writer::merge(write_backing &p, posting_reader &other, read_backing &op, uint32_t id_offset)
+void posting_writer::append(write_backing &p, write_backing &pp, uint32_t id, uint32_t pos)
+{
+  bool first = len == 0;
+  bool new_doc = first || id != last_id;
+
+  if (!new_doc && pos <= last_pos) {
+    return;
+  }
+
+  append(p, id);
+
+  uint8_t *b = ensure_pos_size(pp, pos_len + 5 + 1);
+
+  if (new_doc) {
+    if (!first) {
+      b[pos_len++] = 0;
+    }
+
+    pos_len += vbyte_store(b + pos_len, pos + 1);
+  } else {
+    pos_len += vbyte_store(b + pos_len, pos - last_pos);
+  }
+
+  last_pos = pos;
+}
+
+void posting_writer::append_positions(write_backing &pp, bool first,
+    const std::vector<uint32_t> &positions)
+{
+  uint8_t *b = ensure_pos_size(pp, pos_len + 1 + 5 * positions.size() + 1);
+
+  if (!first) {
+    b[pos_len++] = 0;
+  }
+
+  for (size_t i = 0; i < positions.size(); i++) {
+    if (i == 0) {
+      pos_len += vbyte_store(b + pos_len, positions[i] + 1);
+    } else {
+      pos_len += vbyte_store(b + pos_len, positions[i] - positions[i-1]);
+    }
+  }
+
+  if (!positions.empty()) {
+    last_pos = positions.back();
+  }
+}
+
+size_t posting_writer::merge(write_backing &p, posting_reader &other, read_backing &op, uint32_t id_offset)
 {
   auto posts = other.decompress(op);
 
@@ -93,6 +196,8 @@ void posting_writer::merge(write_backing &p, posting_reader &other, read_backing
   for (auto &post: posts) {
     append(p, post.id + id_offset, post.count);
   }
+
+  return posts.size();
 }
 
 }
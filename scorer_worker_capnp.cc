@@ -27,6 +27,7 @@
 #include "util.h"
 #include "config.h"
 #include "site.h"
+#include "site_view.h"
 
 #include "indexer.capnp.h"
 
@@ -174,27 +175,35 @@ public:
 
     auto sitePath = context.getParams().getSitePath();
 
-    site_map site(sitePath);
-
-    site.load();
+    site_view site(sitePath);
 
     size_t c = 0;
 
-    for (auto p: site.pages) {
-      if (p.last_scanned > 0) {
-        spdlog::info("add page {}", p.url);
+    if (!site.ok()) {
+      spdlog::warn("could not read site {}", site.path);
+      context.getResults().setPageCount(c);
+      return kj::READY_NOW;
+    }
+
+    for (auto p: site.site.getPages()) {
+      if (p.getLastScanned() > 0) {
+        std::string url = p.getUrl();
+
+        spdlog::info("add page {}", url);
+
+        auto p_links = p.getLinks();
 
         std::vector<uint32_t> links;
-        links.reserve(p.links.size());
+        links.reserve(p_links.size());
 
-        for (auto &l: p.links) {
-          auto &l_url = site.urls[l.first];
+        for (auto l: p_links) {
+          auto l_url = site.get_url(l.getUrl());
           links.emplace_back(urlToId(l_url, true));
         }
 
-        auto id = urlToId(p.url, true);
+        auto id = urlToId(url, true);
 
-        nodes.try_emplace(id, p.url, links);
+        nodes.try_emplace(id, url, links);
 
         c++;
       }
@@ -36,13 +36,22 @@ site::site(
     const std::string &n_output,
     size_t n_max_pages,
     size_t n_max_connections,
+    double n_requests_per_second,
     size_t n_max_part_size,
-    size_t n_max_page_size)
+    size_t n_max_page_size,
+    buffer_pool *n_pool)
   : site_map(path), output_dir(n_output),
     max_pages(n_max_pages),
     max_links(n_max_pages * 5),
     max_part_size(n_max_part_size),
-    max_page_size(n_max_page_size)
+    max_page_size(n_max_page_size),
+    archive(n_output, n_max_part_size),
+    pool(n_pool),
+    max_connections(n_max_connections),
+    rate(n_requests_per_second),
+    burst(n_max_connections),
+    tokens(burst),
+    refilled(clock::now())
 {
   load();
 
@@ -50,100 +59,19 @@ site::site(
     spdlog::warn("scrape site given more pages than max pages");
   }
 
-  size_t id = 0;
-  for (auto &u: urls) {
-    url_id_map.emplace(u, id++);
+  for (uint32_t id = 0; id < url_count(); id++) {
+    url_id_map.emplace(get_url(id), id);
   }
 
   for (auto &u: pages) {
-    url_pending.push_back(&u);
-  }
-
-  url_pending.sort([] (auto a, auto b) {
-    return a->url.size() < b->url.size();
-  });
-  
-  // TODO: limit url pending size here
-
-  init_paths();
+    url_pending.push(&u);
 
-  buf_max = n_max_page_size;
-
-  for (size_t i = 0; i < n_max_connections; i++) {
-    uint8_t *buf = (uint8_t *) malloc(buf_max);
-    if (buf == nullptr) {
-      throw std::bad_alloc();
+    if (u.fingerprint != 0) {
+      fingerprints.add(u.fingerprint, &u);
     }
-
-    free_bufs.push_back(buf);
-  }
-}
-
-site::~site() {
-  for (auto b: free_bufs) {
-    free(b);
   }
-}
-
-std::string make_path(const std::string &output_dir, const std::string &url) {
-  auto host = util::get_host(url);
-  if (host.empty()) {
-    return "junk_path";
-  }
-
-  auto path = util::get_path(url);
-  auto path_parts = util::split_path(path);
-
-  auto file_path = output_dir;
 
-  util::make_path(file_path);
-
-  if (path_parts.empty()) {
-    return file_path + "/index";
-  }
-
-  for (int i = 0; i < path_parts.size(); i++) {
-    auto &part = path_parts[i];
-
-    bool need_dir = i + 1 < path_parts.size();
-    bool exists = false;
-
-    auto p = file_path + "/" + part;
-
-    struct stat s;
-    if (stat(p.c_str(), &s) != -1) {
-
-      bool is_dir = (s.st_mode & S_IFMT) == S_IFDIR;
-      bool is_file = (s.st_mode & S_IFMT) == S_IFDIR;
-
-      if (need_dir && !is_dir) {
-        p = file_path + "/" + part + "_dir";
-      } else if (!need_dir && is_dir) {
-        p = file_path + "/" + part + "/index";
-      }
-
-      exists = stat(p.c_str(), &s) != -1;
-
-    } else {
-      exists = false;
-    }
-
-    file_path = p;
-
-    if (!exists) {
-      if (need_dir) {
-        mkdir(file_path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-
-      } else {
-        int fd = creat(file_path.c_str(), S_IRUSR | S_IWUSR);
-        if (fd > 0) {
-          close(fd);
-        }
-      }
-    }
-  }
-
-  return file_path;
+  // TODO: limit url pending size here
 }
 
 bool want_proto(const std::string &proto) {
@@ -234,17 +162,78 @@ bool index_check_path(
   return false;
 }
 
+static pending_queue::key pending_key(const std::string &url) {
+  return {util::get_path(url), url};
+}
+
+bool pending_queue::push(page *p) {
+  auto k = pending_key(p->url);
+  if (index.find(k) != index.end()) {
+    return false;
+  }
+
+  auto it = queue.emplace(p->url.size(), next_seq++, p).first;
+  index.emplace(std::move(k), it);
+
+  return true;
+}
+
+page *pending_queue::pop_front() {
+  auto p = front();
+
+  index.erase(pending_key(p->url));
+  queue.erase(queue.begin());
+
+  return p;
+}
+
+page *pending_queue::pop_back() {
+  auto p = back();
+
+  index.erase(pending_key(p->url));
+  queue.erase(std::prev(queue.end()));
+
+  return p;
+}
+
+page *pending_queue::find(const std::string &url) const {
+  auto it = index.find(pending_key(url));
+  if (it == index.end()) {
+    return nullptr;
+  }
+
+  return std::get<2>(*it->second);
+}
+
+bool pending_queue::erase(const std::string &url) {
+  auto it = index.find(pending_key(url));
+  if (it == index.end()) {
+    return false;
+  }
+
+  queue.erase(it->second);
+  index.erase(it);
+
+  return true;
+}
+
+size_t pending_queue::erase_prefix(const std::string &path) {
+  size_t n = 0;
+
+  auto it = index.lower_bound({path, ""});
+  while (it != index.end() && util::has_prefix(it->first.first, path)) {
+    queue.erase(it->second);
+    it = index.erase(it);
+    n++;
+  }
+
+  return n;
+}
+
 void site::add_disallow(const std::string &path) {
   disallow_path.emplace(path);
 
-  auto u = url_pending.begin();
-  while (u != url_pending.end()) {
-    if (util::has_prefix((*u)->url, path)) {
-      u = url_pending.erase(u);
-    } else {
-      u++;
-    }
-  }
+  url_pending.erase_prefix(path);
 
   /*
   // This will break things wont it?
@@ -292,19 +281,14 @@ void site::process_sitemap_entry(
     return;
   }
 
-  auto u = url_pending.begin();
-  while (u != url_pending.end()) {
-    auto uu = *u;
-    if (uu->url == url) {
-      if (lastmod && *lastmod < uu->last_scanned) {
-        url_unchanged.push_back(uu);
-        url_pending.erase(u);
-      }
-
-      return;
+  auto uu = url_pending.find(url);
+  if (uu != nullptr) {
+    if (lastmod && *lastmod < uu->last_scanned) {
+      url_unchanged.push_back(uu);
+      url_pending.erase(url);
     }
 
-    u++;
+    return;
   }
 
   if (pages.size() + 1 >= max_pages) {
@@ -316,42 +300,33 @@ void site::process_sitemap_entry(
     return;
   }
 
-  auto p = make_path(output_dir, url);
-
-  if (find_page_by_path(p) != nullptr) {
-    spdlog::warn("drop sitemap url {} as in pages (path) already", url);
-    return;
-  }
-
-  maybe_insert_new_pending(url, p);
+  maybe_insert_new_pending(url);
 }
 
+// page_links must be filled in for p, see finish.
 bool site::add_link(page *p, const std::string &n) {
+  uint32_t id;
+
   auto it = url_id_map.find(n);
   if (it == url_id_map.end()) {
-    size_t id = urls.size();
-
+    id = add_url(n);
     url_id_map.emplace(n, id);
-    urls.emplace_back(n);
-
-    p->links.emplace_back(id, 1);
-    return true;
+  } else {
+    id = it->second;
   }
-  
-  size_t id = it->second;
 
-  for (auto &l: p->links) {
-    if (l.first == id) {
-      l.second++;
-      return false;
-    }
+  auto l = page_links.try_emplace(id, p->links.size());
+  if (!l.second) {
+    p->links[l.first->second].second++;
+    return false;
   }
 
   p->links.emplace_back(id, 1);
   return true;
 }
 
-bool site::maybe_insert_new_pending(const std::string &u, const std::string &p) {
+// Only the max_pages shortest urls are kept pending.
+bool site::maybe_insert_new_pending(const std::string &u) {
   if (url_pending.size() >= max_pages) {
     if (url_pending.back()->url.size() > u.size()) {
       url_pending.pop_back();
@@ -360,14 +335,56 @@ bool site::maybe_insert_new_pending(const std::string &u, const std::string &p)
     }
   }
 
-  url_pending.push_back(add_page(u, p));
-  url_pending.sort([] (auto a, auto b) {
-    return a->url.size() < b->url.size();
-  });
+  url_pending.push(add_page(u, ""));
 
   return true;
 }
 
+// Titles as they are kept, without entities or odd characters.
+static std::string clean_title(const std::string &title)
+{
+  std::string t;
+
+  for (int i = 0; i < title.size(); i++) {
+    char c = title[i];
+
+    if (c == '\t' || c == '\n' || c == '\r' || c == '\v') {
+      continue;
+    }
+
+    if (c == '&') {
+      if (title[i+1] == '#') {
+        while (i < title.size()) {
+          if (title[i] == ';') {
+            break;
+          } else {
+            i++;
+          }
+        }
+
+        t += ' ';
+      } else {
+        t += '&';
+      }
+
+      continue;
+    }
+
+    if (('a' <= c && c <= 'z') ||
+        ('A' <= c && c <= 'Z') ||
+        ('0' <= c && c <= '9') ||
+        (c == ' ' || c == '|') ||
+        (c == '+' || c == ',') ||
+        (c == '.' || c == '/') ||
+        (c == '-' || c == '_') ||
+        (c == '(' || c == ')')) {
+      t += c;
+    }
+  }
+
+  return t;
+}
+
 // TODO: effective url check, put as alias.
 
 void site::finish(
@@ -386,6 +403,11 @@ void site::finish(
       url_pending.size(),
       url->url);
 
+  page_links.clear();
+  for (size_t i = 0; i < url->links.size(); i++) {
+    page_links.emplace(url->links[i].first, i);
+  }
+
   for (auto &u: links) {
     auto u_host = util::get_host(u);
     if (u_host.empty()) continue;
@@ -401,66 +423,69 @@ void site::finish(
         continue;
       }
 
-      auto p = make_path(output_dir, u);
-
-      if (find_page_by_path(p) != nullptr) {
-        continue;
-      }
-
-      maybe_insert_new_pending(u, p);
+      maybe_insert_new_pending(u);
     }
   }
 
-  url->title.clear();
+  url->title = clean_title(title);
 
-  for (int i = 0; i < title.size(); i++) {
-    char c = title[i];
+  url->last_scanned = time(NULL);
 
-    if (c == '\t' || c == '\n' || c == '\r' || c == '\v') {
-      continue;
-    }
+  url_scanning.remove(url);
+  url_scanned.push_back(url);
+}
 
-    if (c == '&') {
-      if (title[i+1] == '#') {
-        while (i < title.size()) {
-          if (title[i] == ';') {
-            break;
-          } else {
-            i++;
-          }
-        }
+void site::finish_unchanged(page *url) {
+  spdlog::info("{} finished unchanged {}", host, url->url);
 
-        url->title += ' ';
-      } else {
-        url->title += '&';
-      }
+  url->last_scanned = time(NULL);
 
-      continue;
-    }
+  url_scanning.remove(url);
+  url_unchanged.push_back(url);
+}
 
-    if (('a' <= c && c <= 'z') ||
-        ('A' <= c && c <= 'Z') ||
-        ('0' <= c && c <= '9') ||
-        (c == ' ' || c == '|') ||
-        (c == '+' || c == ',') ||
-        (c == '.' || c == '/') ||
-        (c == '-' || c == '_') ||
-        (c == '(' || c == ')')) {
-      url->title += c;
-    }
+// Templated pages on a site can be a few bits apart with only their
+// content differing, so past one bit the titles have to match too.
+page *site::find_original(page *url, uint64_t f, const std::string &title)
+{
+  if (f == 0) {
+    return nullptr;
   }
 
-  url->last_scanned = time(NULL);
+  auto t = clean_title(title);
 
-  url_scanning.remove(url);
-  url_scanned.push_back(url);
+  auto original = fingerprints.find_if(f, url,
+      [&t] (page *p, int distance) {
+        return distance <= 1 || (!t.empty() && p->title == t);
+      });
+
+  return original ? *original : nullptr;
 }
 
-void site::finish_unchanged(page *url) {
-  spdlog::info("{} finished unchanged {}", host, url->url);
+// The page is dropped, its url going to the page it copies.
+void site::finish_duplicate(page *url, page *original) {
+  spdlog::info("{} finished duplicate {} of {}", host, url->url, original->url);
 
   url_scanning.remove(url);
-  url_unchanged.push_back(url);
+  folded++;
+
+  if (url->fingerprint != 0) {
+    fingerprints.remove(url->fingerprint, url);
+  }
+
+  make_alias(url, original);
+}
+
+void site::set_fingerprint(page *url, uint64_t f) {
+  if (url->fingerprint != 0) {
+    fingerprints.remove(url->fingerprint, url);
+  }
+
+  url->fingerprint = f;
+
+  if (f != 0) {
+    fingerprints.add(f, url);
+  }
 }
 
 void site::finish_bad(page *url, bool actually_bad) {
@@ -491,34 +516,28 @@ bool site::should_finish() {
 }
 
 std::optional<site_op *> site::get_next() {
+  if (active_ops >= max_connections) {
+    return {};
+  }
+
   if (!got_robots) {
     if (getting_robots) {
       return {};
     } else {
-      auto buf = pop_buf();
-      if (buf) {
-        getting_robots = true;
-        spdlog::debug("{} get next robots", host);
-        return new site_op_robots(this, buf, buf_max);
-      } else {
-        return {};
-      }
+      getting_robots = true;
+      spdlog::debug("{} get next robots", host);
+      return new site_op_robots(this);
     }
   }
 
   if (!sitemap_url_pending.empty()) {
-    auto buf = pop_buf();
-    if (buf) {
-      std::string url = *sitemap_url_pending.begin();
+    std::string url = *sitemap_url_pending.begin();
 
-      sitemap_url_pending.erase(url);
-      sitemap_url_getting.insert(url);
+    sitemap_url_pending.erase(url);
+    sitemap_url_getting.insert(url);
 
-      spdlog::debug("{} get next sitemap {}", host, url);
-      return new site_op_sitemap(this, buf, buf_max, url);
-    } else {
-      return {};
-    }
+    spdlog::debug("{} get next sitemap {}", host, url);
+    return new site_op_sitemap(this, url);
   }
 
   if (!sitemap_url_getting.empty()) {
@@ -535,19 +554,42 @@ std::optional<site_op *> site::get_next() {
     return {};
   }
 
-  auto buf = pop_buf();
-  if (buf) {
-    auto page = url_pending.front();
-    url_pending.pop_front();
-    url_scanning.push_back(page);
+  auto page = url_pending.pop_front();
+  url_scanning.push_back(page);
+
+  spdlog::debug("{} get next page {}", host, page->url);
 
-    spdlog::debug("{} get next page {}", host, page->url);
+  return new site_op_page(this, page);
+}
 
-    return new site_op_page(this, buf, buf_max, page);
+void site::set_crawl_delay(double seconds) {
+  // Any longer and the site would never finish.
+  seconds = std::min(seconds, 60.0);
 
-  } else {
-    return {};
+  spdlog::debug("{} crawl delay {}", host, seconds);
+
+  rate = std::min(rate, 1.0 / seconds);
+  burst = 1;
+  tokens = std::min(tokens, burst);
+}
+
+site::clock::time_point site::ready_at(clock::time_point now) {
+  if (rate <= 0) {
+    return now;
+  }
+
+  std::chrono::duration<double> since = now - refilled;
+
+  tokens = std::min(burst, tokens + since.count() * rate);
+  refilled = now;
+
+  if (tokens >= 1) {
+    return now;
   }
+
+  std::chrono::duration<double> wait((1 - tokens) / rate);
+
+  return now + std::chrono::duration_cast<clock::duration>(wait);
 }
 
 bool site::finished() {
@@ -578,13 +620,5 @@ bool site::disallow_url(const std::string &u) {
   return false;
 }
 
-void site::init_paths() {
-  for (auto &i: url_pending) {
-    if (i->path == "") {
-      i->path = make_path(output_dir, i->url);
-    }
-  }
-}
-
 }
 
@@ -2,10 +2,17 @@
 #define SCRAPE_H
 
 #include <set>
+#include <map>
 #include <list>
 #include <vector>
+#include <tuple>
+#include <chrono>
+#include <unordered_map>
 
 #include "site.h"
+#include "archive.h"
+#include "buffer_pool.h"
+#include "simhash.h"
 
 namespace scrape {
 
@@ -15,58 +22,186 @@ struct site_op {
   site *m_site;
   std::string url;
 
-  uint8_t *buf;
-  size_t buf_max;
-
+  size_t max_size;
   size_t size{0};
 
-  site_op(site *s, const std::string &url, uint8_t *b, size_t max)
-    : m_site(s), url(url), buf(b), buf_max(max)
-  {}
+  // Asks for the body only if it changed since. The etag is then
+  // replaced with whatever the server sent back.
+  time_t if_modified_since{0};
+  std::string etag;
+
+  site_op(site *s, const std::string &url);
 
   virtual ~site_op();
 
-  //virtual void setup_handle(CURL *) = 0;
+  // Takes the next part of the body, false once it is over
+  // max_size.
+  bool write(const uint8_t *data, size_t n);
+
+  // Told the length when the server gives one, false if it is
+  // over max_size.
+  bool expect(size_t len);
+
+  virtual void reserve(size_t len) {}
+  virtual void add(const uint8_t *data, size_t n) = 0;
 
   virtual void finish(const std::string &effective_url) = 0;
   virtual void finish_bad(bool) = 0;
+
+  // A 304, only conditional requests get them.
+  virtual void finish_unchanged() {
+    finish_bad(false);
+  }
+};
+
+// Picks the links and title out of a page as it comes in, so
+// pages are never held whole.
+struct page_scanner {
+  enum { TEXT, TAG, SKIP, TITLE } state{TEXT};
+
+  std::string tag;
+
+  // What SKIP and TITLE are looking for and how much of it has
+  // matched.
+  const char *until{nullptr};
+  size_t until_i{0};
+
+  bool in_head{false};
+  bool got_title{false};
+
+  // Inside nav, header, footer or aside. Their text is the same
+  // across a site so it is left out of the fingerprint.
+  size_t in_chrome{0};
+  std::string title;
+
+  size_t max_links;
+  std::vector<std::string> hrefs;
+
+  // Words in the text go into a SimHash three at a time.
+  std::string word;
+  uint64_t last_words[2]{};
+  size_t words{0};
+  simhash shingles;
+
+  page_scanner(size_t max_links)
+    : max_links(max_links)
+  {}
+
+  void add(const char *data, size_t n);
+
+  // 0 if there was too little text to go on.
+  uint64_t fingerprint();
+
+private:
+  void end_tag();
+  void end_word();
+  bool match_until(char c);
 };
 
 struct site_op_page : public site_op {
   page *m_page;
-  bool unchanged{false};
 
-  site_op_page(site *s, uint8_t *b, size_t max, page *p);
+  page_scanner scanner;
+  archive::body body;
+
+  site_op_page(site *s, page *p);
   ~site_op_page() {}
 
   void save();
 
-  void process_page(const std::string &page_url,
-      std::vector<std::string> &links,
-      std::string &title);
+  void add(const uint8_t *data, size_t n);
 
   void finish(const std::string &effective_url);
   void finish_bad(bool);
+  void finish_unchanged();
+};
+
+// Robots and sitemaps are small and parsed once they are all
+// here.
+struct site_op_buffered : public site_op {
+  // Taken from the site's pool as it needs to grow, the first size
+  // bytes are the body.
+  std::vector<uint8_t> buf;
+
+  site_op_buffered(site *s, const std::string &url)
+    : site_op(s, url)
+  {}
+
+  ~site_op_buffered();
+
+  void reserve(size_t len);
+  void add(const uint8_t *data, size_t n);
 };
 
-struct site_op_robots : public site_op {
-  site_op_robots(site *s, uint8_t *b, size_t max);
+struct site_op_robots : public site_op_buffered {
+  site_op_robots(site *s);
   ~site_op_robots() {}
 
   void finish(const std::string &effective_url);
   void finish_bad(bool);
 };
 
-struct site_op_sitemap : public site_op {
-  site_op_sitemap(site *s, uint8_t *b, size_t max, std::string u);
+struct site_op_sitemap : public site_op_buffered {
+  site_op_sitemap(site *s, std::string u);
   ~site_op_sitemap() {}
 
   void finish(const std::string &effective_url);
   void finish_bad(bool);
 };
 
+// Pages waiting to be scraped, shortest url first then in the
+// order they were added. Indexed by url so a page can be found or
+// dropped without going through the lot.
+struct pending_queue {
+  typedef std::tuple<size_t, uint64_t, page *> entry;
+
+  std::set<entry> queue;
+
+  // By path then url so the urls under a disallowed path are one
+  // range.
+  typedef std::pair<std::string, std::string> key;
+  std::map<key, std::set<entry>::iterator> index;
+
+  uint64_t next_seq{0};
+
+  size_t size() const {
+    return queue.size();
+  }
+
+  bool empty() const {
+    return queue.empty();
+  }
+
+  auto begin() const {
+    return queue.begin();
+  }
+
+  auto end() const {
+    return queue.end();
+  }
+
+  page *front() const {
+    return std::get<2>(*queue.begin());
+  }
+
+  page *back() const {
+    return std::get<2>(*queue.rbegin());
+  }
+
+  bool push(page *p);
+
+  page *pop_front();
+  page *pop_back();
+
+  page *find(const std::string &url) const;
+  bool erase(const std::string &url);
+
+  // Drops every url whose path starts with path.
+  size_t erase_prefix(const std::string &path);
+};
+
 struct site : public site_map {
-  std::list<page *> url_pending;
+  pending_queue url_pending;
   std::list<page *> url_scanning;
 
   std::vector<page *> url_scanned;
@@ -81,7 +216,15 @@ struct site : public site_map {
   std::set<std::string> sitemap_url_getting;
   std::set<std::string> sitemap_url_got;
   
-  std::unordered_map<std::string, size_t> url_id_map;
+  std::unordered_map<std::string, uint32_t> url_id_map;
+
+  fingerprint_index<page *> fingerprints;
+
+  // Pages folded into another this crawl.
+  size_t folded{0};
+
+  // Url id to index in links for the page being finished.
+  std::unordered_map<uint32_t, size_t> page_links;
 
   std::string output_dir;
   size_t max_pages;
@@ -91,63 +234,49 @@ struct site : public site_map {
 
   size_t fail{0};
 
-  std::vector<uint8_t *> free_bufs;
-  std::vector<uint8_t *> using_bufs;
-  size_t buf_max;
+  // Fetched pages are appended here, rolling over to a new
+  // segment every max_part_size.
+  archive::writer archive;
+
+  // The crawler's, shared by all sites.
+  buffer_pool *pool;
+
+  size_t max_connections;
+  size_t active_ops{0};
+
+  typedef std::chrono::steady_clock clock;
+
+  // Requests are spaced out with a token bucket refilled at rate a
+  // second up to burst. A Crawl-delay in robots.txt drops it to one
+  // request per delay.
+  double rate;
+  double burst;
+  double tokens;
+  clock::time_point refilled;
 
   site(const std::string &path,
       const std::string &n_output,
       size_t n_max_pages,
       size_t n_max_connections,
+      double n_requests_per_second,
       size_t n_max_part_size,
-      size_t n_max_page_size);
+      size_t n_max_page_size,
+      buffer_pool *n_pool);
 
   site(site &&o) = default;
   site(site &o) = delete;
 
-  ~site();
-
-  uint8_t *pop_buf() {
-    if (free_bufs.empty()) {
-      return nullptr;
-    }
-
-    uint8_t *b = free_bufs.back();
-    free_bufs.pop_back();
-
-    using_bufs.push_back(b);
-
-    return b;
-  }
-
-  void push_buf(uint8_t *b) {
-    if (b == nullptr) {
-      throw std::invalid_argument("push_buf with null");
-    }
-
-    free_bufs.push_back(b);
-
-    auto it = using_bufs.begin();
-    while (it != using_bufs.end()) {
-      if (*it == b) {
-        using_bufs.erase(it);
-        break;
-      }
-
-      it++;
-    }
-  }
-
-  void init_paths();
-
   void add_sitemap(const std::string &url);
   void process_sitemap_entry(const std::string &url, std::optional<time_t> lastmod);
   void add_disallow(const std::string &path);
 
-  bool maybe_insert_new_pending(const std::string &u, const std::string &p);
+  bool maybe_insert_new_pending(const std::string &u);
   bool add_link(page *p, const std::string &n);
   void finish(page *u, std::vector<std::string> &links, std::string &title);
   void finish_unchanged(page *u);
+  page *find_original(page *u, uint64_t f, const std::string &title);
+  void finish_duplicate(page *u, page *original);
+  void set_fingerprint(page *u, uint64_t f);
   void finish_bad(page *u, bool actually_bad);
 
   bool should_finish();
@@ -155,6 +284,14 @@ struct site : public site_map {
 
   std::optional<site_op*> get_next();
 
+  void set_crawl_delay(double seconds);
+
+  // When the next request can go, now if there is a token.
+  clock::time_point ready_at(clock::time_point now);
+  void spend_token() {
+    tokens -= 1;
+  }
+
   bool disallow_url(const std::string &u);
 };
 
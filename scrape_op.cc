@@ -28,39 +28,90 @@ using namespace std::chrono_literals;
 
 namespace scrape {
 
+site_op::site_op(site *s, const std::string &url)
+  : m_site(s), url(url), max_size(s->max_page_size)
+{
+  m_site->active_ops++;
+}
+
 site_op::~site_op() {
-  m_site->push_buf(buf);
+  m_site->active_ops--;
 }
 
-site_op_page::site_op_page(site *s, uint8_t *b, size_t max, page *p)
-  : site_op(s, p->url, b, max),
-    m_page(p)
-{}
+bool site_op::write(const uint8_t *data, size_t n) {
+  if (size + n > max_size) {
+    return false;
+  }
+
+  add(data, n);
+  size += n;
+
+  return true;
+}
+
+bool site_op::expect(size_t len) {
+  if (len > max_size) {
+    spdlog::debug("{} is too big at {}", url, len);
+    return false;
+  }
+
+  reserve(len);
+
+  return true;
+}
+
+site_op_buffered::~site_op_buffered() {
+  m_site->pool->give(std::move(buf));
+}
 
-site_op_robots::site_op_robots(site *s, uint8_t *b, size_t max)
-  : site_op(s,
-      fmt::format("https://{}/robots.txt", s->host),
-      b, max)
+void site_op_buffered::reserve(size_t len) {
+  m_site->pool->grow(buf, size, len);
+}
+
+void site_op_buffered::add(const uint8_t *data, size_t n) {
+  m_site->pool->grow(buf, size, size + n);
+  memcpy(buf.data() + size, data, n);
+}
+
+site_op_page::site_op_page(site *s, page *p)
+  : site_op(s, p->url),
+    m_page(p),
+    scanner(s->max_links),
+    body(s->archive.start_body(s->pool))
+{
+  // Only worth asking if we still have what we got last time.
+  if (p->last_scanned > 0 && !p->path.empty()) {
+    if_modified_since = p->last_scanned;
+    etag = p->etag;
+  }
+}
+
+site_op_robots::site_op_robots(site *s)
+  : site_op_buffered(s,
+      fmt::format("https://{}/robots.txt", s->host))
 {}
 
-site_op_sitemap::site_op_sitemap(site *s, uint8_t *b, size_t max, std::string u)
-  : site_op(s, u, b, max)
+site_op_sitemap::site_op_sitemap(site *s, std::string u)
+  : site_op_buffered(s, u)
 {}
 
-void site_op_page::save()
+void site_op_page::add(const uint8_t *data, size_t n)
 {
-  std::ofstream file;
-
-  file.open(m_page->path, std::ios::out | std::ios::binary | std::ios::trunc);
+  scanner.add((const char *) data, n);
+  body.add(data, n);
+}
 
-  if (!file.is_open()) {
-    spdlog::warn("error opening file {} for {}", m_page->path, m_page->url);
+void site_op_page::save()
+{
+  auto r = m_site->archive.append(m_page->url, m_page->last_scanned, body);
+  if (!r) {
+    spdlog::warn("error archiving {}", m_page->url);
     return;
   }
 
-  file.write((char *) buf, size);
-
-  file.close();
+  m_page->path = r->path;
+  m_page->archive_offset = r->offset;
+  m_page->archive_size = r->size;
 }
 
 std::optional<std::string> process_link(
@@ -112,69 +163,171 @@ std::optional<std::string> process_link(
   return proto + "://" + host + path;
 }
 
-void site_op_page::process_page(const std::string &page_url,
-    std::vector<std::string> &links,
-    std::string &title)
+// Sees if c carries on matching until, adding what turned out not
+// to be part of it to the title.
+bool page_scanner::match_until(char c)
 {
-  char tok_buffer_store[1024];
-	struct str tok_buffer;
-	str_init(&tok_buffer, tok_buffer_store, sizeof(tok_buffer_store));
+  if (c == until[until_i]) {
+    if (until[++until_i] == 0) {
+      until_i = 0;
+      return true;
+    }
 
-  tokenizer::token_type token;
-  tokenizer::tokenizer tok((const char *) buf, size);
+    return false;
+  }
+
+  if (state == TITLE) {
+    for (size_t i = 0; i < until_i && title.size() < 1023; i++) {
+      title.push_back(until[i]);
+    }
+  }
 
-  auto page_proto = util::get_proto(page_url);
-  auto page_host = util::get_host(page_url);
-  auto page_dir = util::get_dir(util::get_path(page_url));
+  until_i = 0;
 
-  if (page_proto.empty() || page_host.empty() || page_dir.empty()) {
-    spdlog::error("BAD PAGE URL '{}' : '{}' -> '{}' '{}' '{}'",
-        m_page->url, page_url, page_proto, page_host, page_dir);
+  if (c == until[0]) {
+    until_i = 1;
+  } else if (state == TITLE && title.size() < 1023) {
+    title.push_back(c);
+  }
+
+  return false;
+}
 
+void page_scanner::end_tag()
+{
+  // Self closing tags never held anything we want.
+  if (!tag.empty() && tag.back() == '/') {
     return;
   }
 
-  bool in_head = false;
-  bool got_title = false;
-  do {
-    token = tok.next(&tok_buffer);
+  if (util::has_prefix(tag, "script")) {
+    state = SKIP;
+    until = "</script>";
+    return;
 
-    if (token == tokenizer::TAG) {
-      char tag_name[tokenizer::tag_name_max_len];
-      tokenizer::get_tag_name(tag_name, str_c(&tok_buffer));
+  } else if (util::has_prefix(tag, "style")) {
+    state = SKIP;
+    until = "</style>";
+    return;
+  }
 
-      if (strcmp(tag_name, "a") == 0) {
-        char attr[tokenizer::attr_value_max_len];
-        if (tokenizer::get_tag_attr(attr, "href", str_c(&tok_buffer))) {
-          auto s = process_link(page_proto, page_host, page_dir, std::string(attr));
-          if (s.has_value()) {
-            links.push_back(*s);
-
-            if (links.size() == links.capacity()) {
-              spdlog::warn("hit max links for page {}", page_url);
-              return;
-            }
-          }
+  char tag_name[tokenizer::tag_name_max_len];
+  tokenizer::get_tag_name(tag_name, tag.data());
+
+  if (strcmp(tag_name, "a") == 0) {
+    char attr[tokenizer::attr_value_max_len];
+    if (hrefs.size() < max_links &&
+        tokenizer::get_tag_attr(attr, "href", tag.data())) {
+      hrefs.emplace_back(attr);
+    }
+
+    // only do this in head.
+    // https://whereismyspoon.co/category/main-dish/meat/
+    // this page has svg's with titles.
+    // also only take first
+    // and make sure not in a sub tag?.
+  } else if (strcmp(tag_name, "head") == 0) {
+    in_head = true;
+  } else if (strcmp(tag_name, "/head") == 0) {
+    in_head = false;
+
+  } else if (strcmp(tag_name, "nav") == 0 ||
+             strcmp(tag_name, "header") == 0 ||
+             strcmp(tag_name, "footer") == 0 ||
+             strcmp(tag_name, "aside") == 0) {
+    in_chrome++;
+  } else if (in_chrome > 0 &&
+             (strcmp(tag_name, "/nav") == 0 ||
+              strcmp(tag_name, "/header") == 0 ||
+              strcmp(tag_name, "/footer") == 0 ||
+              strcmp(tag_name, "/aside") == 0)) {
+    in_chrome--;
+
+  } else if (in_head && !got_title && strcmp(tag_name, "title") == 0) {
+    state = TITLE;
+    until = "</title>";
+    got_title = true;
+  }
+}
+
+void page_scanner::end_word()
+{
+  if (word.empty()) {
+    return;
+  }
+
+  if (in_head || in_chrome > 0) {
+    word.clear();
+    return;
+  }
+
+  uint64_t h = mix64(std::hash<std::string>{}(word));
+  word.clear();
+
+  if (words >= 2) {
+    auto rotl = [] (uint64_t x, int r) {
+      return (x << r) | (x >> (64 - r));
+    };
+
+    shingles.add(mix64(h ^ rotl(last_words[0], 21) ^ rotl(last_words[1], 42)));
+  }
+
+  last_words[1] = last_words[0];
+  last_words[0] = h;
+  words++;
+}
+
+uint64_t page_scanner::fingerprint()
+{
+  end_word();
+
+  // Too few to tell a page from its neighbour.
+  if (shingles.count < 16) {
+    return 0;
+  }
+
+  return shingles.value();
+}
+
+void page_scanner::add(const char *data, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    char c = data[i];
+
+    switch (state) {
+    case TEXT:
+      if (isalnum((unsigned char) c)) {
+        if (word.size() < 64) {
+          word.push_back(tolower((unsigned char) c));
         }
 
-        // only do this in head.
-        // https://whereismyspoon.co/category/main-dish/meat/
-        // this page has svg's with titles.
-        // also only take first
-        // and make sure not in a sub tag?.
-      } else if (strcmp(tag_name, "head") == 0) {
-        in_head = true;
-      } else if (strcmp(tag_name, "/head") == 0) {
-        in_head = false;
-
-      } else if (in_head && !got_title && strcmp(tag_name, "title") == 0) {
-        tok.consume_until("</title>", &tok_buffer);
-        title = std::string(str_c(&tok_buffer));
-        got_title = true;
+      } else {
+        end_word();
+
+        if (c == '<') {
+          state = TAG;
+          tag.clear();
+        }
       }
-    }
+      break;
+
+    case TAG:
+      if (c == '>') {
+        state = TEXT;
+        end_tag();
+      } else if (tag.size() < 1023) {
+        tag.push_back(c);
+      }
+      break;
 
-  } while (token != tokenizer::END);
+    case SKIP:
+    case TITLE:
+      if (match_until(c)) {
+        state = TEXT;
+      }
+      break;
+    }
+  }
 }
 
 void site_op_page::finish(const std::string &effective_url)
@@ -187,15 +340,47 @@ void site_op_page::finish(const std::string &effective_url)
         m_page->url, effective_url);
 
     m_site->finish_bad(m_page, false);
+    return;
+  }
+
+  // Query strings, trailing slashes and print views, the same page
+  // under another url.
+  auto fingerprint = scanner.fingerprint();
+  auto original = m_site->find_original(m_page, fingerprint, scanner.title);
+  if (original) {
+    m_site->finish_duplicate(m_page, original);
+    return;
   }
 
-  std::string title = "";
+  m_site->set_fingerprint(m_page, fingerprint);
+
+  auto page_proto = util::get_proto(effective_url);
+  auto page_host = util::get_host(effective_url);
+  auto page_dir = util::get_dir(util::get_path(effective_url));
+
   std::vector<std::string> links;
-  links.reserve(m_site->max_links);
+  links.reserve(scanner.hrefs.size());
+
+  if (page_proto.empty() || page_host.empty() || page_dir.empty()) {
+    spdlog::error("BAD PAGE URL '{}' : '{}' -> '{}' '{}' '{}'",
+        m_page->url, effective_url, page_proto, page_host, page_dir);
+
+  } else {
+    for (auto &href: scanner.hrefs) {
+      auto s = process_link(page_proto, page_host, page_dir, href);
+      if (s.has_value()) {
+        links.push_back(*s);
+      }
+    }
+
+    if (scanner.hrefs.size() == scanner.max_links) {
+      spdlog::warn("hit max links for page {}", effective_url);
+    }
+  }
 
-  process_page(effective_url, links, title);
+  m_page->etag = etag;
 
-  m_site->finish(m_page, links, title);
+  m_site->finish(m_page, links, scanner.title);
 
   save();
 }
@@ -208,9 +393,7 @@ void site_op_robots::finish(const std::string &effective_url) {
 
   m_site->disallow_path.clear();
 
-  std::string file = std::string(buf, buf + size);
-
-  std::istringstream fss(file);
+  std::istringstream fss(std::string((const char *) buf.data(), size));
 
   bool matching_useragent = true;
 
@@ -242,6 +425,14 @@ void site_op_robots::finish(const std::string &effective_url) {
         m_site->add_disallow(value);
       }
 
+    } else if (key == "Crawl-delay" || key == "Crawl-Delay") {
+      if (matching_useragent) {
+        double delay = strtod(value.c_str(), nullptr);
+        if (delay > 0) {
+          m_site->set_crawl_delay(delay);
+        }
+      }
+
     } else if (key == "Sitemap") {
       m_site->add_sitemap(value);
     }
@@ -259,7 +450,7 @@ void site_op_sitemap::finish(const std::string &effective_url) {
 	str_init(&tok_buffer, tok_buffer_store, sizeof(tok_buffer_store));
 
   tokenizer::token_type token;
-  tokenizer::tokenizer tok((const char *) buf, size);
+  tokenizer::tokenizer tok((const char *) buf.data(), size);
 
   std::optional<std::string> url_loc = {};
   std::optional<time_t> url_lastmod = {};
@@ -331,14 +522,13 @@ void site_op_sitemap::finish(const std::string &effective_url) {
 }
 
 void site_op_page::finish_bad(bool bad) {
-  if (unchanged) {
-    m_site->finish_unchanged(m_page);
-    return;
-  }
-
   m_site->finish_bad(m_page, bad);
 }
 
+void site_op_page::finish_unchanged() {
+  m_site->finish_unchanged(m_page);
+}
+
 void site_op_robots::finish_bad(bool) {
   m_site->getting_robots = false;
   m_site->got_robots = true;
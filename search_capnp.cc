@@ -24,6 +24,7 @@
 #include "util.h"
 #include "config.h"
 #include "index.h"
+#include "loop_thread.h"
 
 #include "indexer.capnp.h"
 
@@ -48,6 +49,29 @@ class SearcherImpl final:
             public kj::HttpService,
             public kj::TaskSet::ErrorHandler {
 
+  struct search_match {
+    std::string url;
+    std::string title;
+    std::string path;
+    float match;
+    float rank;
+
+    search_match(const std::string &url,
+                 const std::string &title,
+                 const std::string &path,
+                 float match, float rank)
+      : url(url), title(title), path(path),
+        match(match), rank(rank)
+    {}
+
+    float score() const {
+      return (0.7 * match) + (0.3 * match * rank);
+    }
+  };
+
+  // Streams the results page as chunked output. The head and search
+  // form go out straight away, results follow in batches as their
+  // page info comes back from the master.
   struct adaptor {
   public:
     adaptor(kj::PromiseFulfiller<void> &fulfiller,
@@ -57,115 +81,91 @@ class SearcherImpl final:
         : fulfiller(fulfiller),
           searcher(searcher),
           query(query),
-          response(response)
+          response(response),
+          buf(searcher.pop_buf())
     {
+      kj::HttpHeaders respHeaders(*searcher.hTable);
+      respHeaders.set(searcher.hContentType, "text/html");
+
+      // No content length so kj uses chunked encoding.
+      stream = response.send(200, "OK", respHeaders);
+
+      write_head();
+
       if (query != "") {
         search();
       } else {
-        respond();
+        write_tail();
       }
     }
 
+    ~adaptor() {
+      searcher.push_buf(std::move(buf));
+    }
+
     void search() {
-      char query_c[1024];
-      strncpy(query_c, query.c_str(), sizeof(query_c));
+      searcher.tasks.add(searcher.findMatches(query, max_matches).then(
+            [this] (auto m) {
+              matches = std::move(m);
+              lookup_next();
+            },
+            [this] (auto exception) {
+              spdlog::warn("error finding matches for {}: {}", query,
+                  std::string(exception.getDescription()));
 
-      auto postings = searcher.searcher.find_matches(query_c);
+              write_tail();
+            }));
+    }
 
-      if (postings.empty()) {
-        respond();
+    // Look up the next batch of matches. Each batch is written as
+    // soon as it resolves while the lookups for the one after it
+    // go out.
+    void lookup_next() {
+      if (next == matches.size()) {
+        write_tail();
         return;
       }
 
-      auto intersected = search::intersect_postings(postings);
+      size_t end = std::min(next + batch_size, matches.size());
 
-      intersected.sort(
-          [] (auto &a, auto &b) {
-              return a.second > b.second;
-          });
+      std::vector<std::pair<std::string, double>> slice(
+          matches.begin() + next, matches.begin() + end);
 
-      pending = 0;
-      for (auto &page: intersected) {
-        auto request = searcher.master.getPageInfoRequest();
-
-        request.setUrl(page.first);
-
-        searcher.tasks.add(request.send().then(
-              [this, page] (auto result) {
-                spdlog::trace("got page info for {}", page.first);
-
-                float score = result.getScore();
-                std::string title = result.getTitle();
-                std::string path = result.getPath();
-
-                spdlog::trace("got page info for {} : {} '{}' '{}'", page.first, score, title, path);
-
-                if (title != "" && path != "") {
-                  results.emplace_back(
-                      page.first,
-                      result.getTitle(),
-                      result.getPath(),
-                      page.second,
-                      result.getScore());
-                }
-
-                pending--;
-                if (pending == 0) {
-                  respond();
-                }
-              },
-              [this, page] (auto exception) {
-                spdlog::warn("error getting page info {}: {}", page.first,
-                    std::string(exception.getDescription()));
-
-                pending--;
-                if (pending == 0) {
-                  respond();
-                }
-              }));
-
-        pending++;
-        if (pending > 300) {
-          break;
-        }
-      }
+      next = end;
 
-      if (pending == 0) {
-        respond();
-      }
+      searcher.tasks.add(searcher.lookupPages(std::move(slice)).then(
+            [this] (auto batch) {
+              write_batch(std::move(batch));
+              lookup_next();
+            }));
     }
 
-    void respond() {
-      std::string result_body;
-
-      double sum_rank = 0;
-      for (auto &r: results) {
-        sum_rank += r.rank;
-      }
-
-      if (sum_rank > 0) {
-        for (auto &r: results) {
-          spdlog::debug("rank {} : {}", r.url, r.rank);
-          r.rank /= sum_rank;
-        }
-      }
-
-      std::sort(results.begin(), results.end(),
+    // The matches were normalized once over the whole top k by
+    // findMatches and batches go out in match order, so a batch is
+    // only sorted within itself.
+    void write_batch(std::vector<search_match> batch) {
+      std::sort(batch.begin(), batch.end(),
           [] (auto &a, auto &b) {
               return a.score() > b.score();
           });
 
-      for (auto &result: results) {
-        result_body += fmt::format("<li>{:.6f} : {:.8f}  <a href=\"{}\">{}</a>  <a href=\"{}\">{}</a></li>",
-            result.match,
-            result.rank,
-            result.url,
-            result.title,
-            result.url,
-            result.path);
-      }
+      write([batch = std::move(batch)] (std::string &out) {
+          for (auto &result: batch) {
+            fmt::format_to(std::back_inserter(out),
+                "<li>{:.6f} : {:.8f}  <a href=\"{}\">{}</a>  <a href=\"{}\">{}</a></li>\n",
+                result.match,
+                result.rank,
+                result.url,
+                result.title,
+                result.url,
+                result.path);
+          }
+        });
+    }
 
-      body = kj::str(fmt::format(R"HTML(
+    void write_head() {
+      write([q = query] (std::string &out) {
+          fmt::format_to(std::back_inserter(out), R"HTML(
   <html>
       <head>
           <title>{} | Search</title>
@@ -180,27 +180,45 @@ class SearcherImpl final:
           </div>
           <div id="results">
               <ul>
-              {}
+)HTML", q, q);
+        });
+    }
+
+    void write_tail() {
+      write([] (std::string &out) {
+          out += R"HTML(
               </ul>
           </div>
       </body>
   </html>
-          )HTML", std::string(query), std::string(query), result_body));
-
-      kj::HttpHeaders respHeaders(*searcher.hTable);
-      respHeaders.set(searcher.hContentType, "text/html");
+)HTML";
+        });
 
-      stream = response.send(200, "OK", respHeaders, body.size());
-      searcher.tasks.add(stream->write(body.begin(), body.size()).then(
+      searcher.tasks.add(writing.then(
             [this] () {
               spdlog::info("finished sending");
               finish();
             },
-            [] (auto exception) {
+            [this] (auto exception) {
               spdlog::warn("error writing result: {}", std::string(exception.getDescription()));
+              fulfiller.reject(kj::mv(exception));
             }));
     }
 
+    // Writes are chained so only one is outstanding on the stream at
+    // a time, each filling the pooled buffer once the last is done
+    // with it. They are evaluated eagerly so each goes out as soon
+    // as the one before it has, errors are left for write_tail.
+    template <typename F>
+    void write(F fill) {
+      writing = writing.then(
+          [this, fill = std::move(fill)] () mutable {
+            buf.clear();
+            fill(buf);
+            return stream->write(buf.data(), buf.size());
+          }).eagerlyEvaluate(nullptr);
+    }
+
     void finish() {
       fulfiller.fulfill();
     }
@@ -210,66 +228,453 @@ class SearcherImpl final:
     std::string query;
     Response &response;
 
-    struct search_match {
-      std::string url;
-      std::string title;
-      std::string path;
-      float match;
-      float rank;
-
-      search_match(const std::string &url,
-                   const std::string &title,
-                   const std::string &path,
-                   float match, float rank)
-        : url(url), title(title), path(path),
-          match(match), rank(rank)
-      {}
-
-      float score() {
-        return (0.7 * match) + (0.3 * match * rank);
-      }
-    };
+    static const size_t max_matches = 300;
+    static constexpr size_t batch_size = 50;
 
-    size_t pending;
-    std::vector<search_match> results;
+    std::vector<std::pair<std::string, double>> matches;
+    size_t next{0};
 
-    kj::String body;
+    std::string buf;
+    kj::Promise<void> writing{kj::READY_NOW};
     kj::Own<kj::AsyncOutputStream> stream;
   };
 
+  // Output buffers are kept between requests so each response does
+  // not have to grow a new one.
+  std::string pop_buf() {
+    if (free_bufs.empty()) {
+      std::string b;
+      b.reserve(16 * 1024);
+      return b;
+    }
+
+    std::string b = std::move(free_bufs.back());
+    free_bufs.pop_back();
+    return b;
+  }
+
+  void push_buf(std::string &&b) {
+    if (free_bufs.size() < max_free_bufs) {
+      b.clear();
+      free_bufs.push_back(std::move(b));
+    }
+  }
+
 public:
   SearcherImpl(kj::AsyncIoContext &io_context,
       kj::HttpHeaderTable::Builder &builder,
-      kj::Own<kj::NetworkAddress> &listenAddr,
-      const config &s, Master::Client master)
+      kj::NetworkAddress *listenAddr,
+      const config &s, Master::Client master,
+      bool front_end, size_t shard)
     : settings(s),
       searcher(s.merger.meta_path, s.merger.max_index_part_size),
       master(master),
       urlBase(kj::Url::parse("http://localhost/")),
-      tasks(*this), timer(io_context.provider->getTimer())
+      tasks(*this), timer(io_context.provider->getTimer()),
+      front_end(front_end), shard(shard)
   {
-    searcher.load();
+    // The front end of a sharded search does not hold any of the
+    // index itself, it scatters queries to the shards.
+    if (!front_end) {
+      searcher.load(shard, settings.searcher.shards);
+      workers = kj::heap<worker_pool>(std::max(1u, std::thread::hardware_concurrency()));
+    } else if (settings.searcher.shards <= 1) {
+      searcher.load();
+      workers = kj::heap<worker_pool>(std::max(1u, std::thread::hardware_concurrency()));
+    } else {
+      updateShards();
+    }
 
     hAccept = builder.add("Accept");
     hContentType = builder.add("Content-Type");
 
     hTable = builder.build();
 
-    server = kj::heap<kj::HttpServer>(timer, *hTable, *this);
+    if (listenAddr != nullptr) {
+      server = kj::heap<kj::HttpServer>(timer, *hTable, *this);
+
+      receiver = listenAddr->listen();
+
+      tasks.add(server->listenHttp(*receiver));
+    }
+  }
+
+  bool sharded() {
+    return front_end && settings.searcher.shards > 1;
+  }
+
+  void updateShards() {
+    auto request = master.getSearchersRequest();
+
+    tasks.add(request.send().then(
+        [this] (auto result) {
+          shards.clear();
+
+          for (auto s: result.getSearchers()) {
+            shards.push_back(s);
+          }
+
+          spdlog::info("have {} / {} search shards",
+              shards.size(), settings.searcher.shards);
+        },
+        [] (auto exception) {
+          spdlog::warn("error getting search shards: {}",
+              std::string(exception.getDescription()));
+        }));
+
+    tasks.add(timer.afterDelay(30 * kj::SECONDS).then(
+        [this] () {
+          updateShards();
+        }));
+  }
+
+  // Local matches sorted best first. Shards do not normalize so that
+  // their scores can be compared once merged. The parts are looked
+  // up on the worker threads, a part that fails only loses its own
+  // matches.
+  kj::Promise<std::vector<std::pair<std::string, double>>>
+  searchLocal(const std::string &query, size_t k, bool normalize)
+  {
+    char query_c[1024];
+    strncpy(query_c, query.c_str(), sizeof(query_c) - 1);
+    query_c[sizeof(query_c) - 1] = 0;
+
+    auto terms = kj::heap(searcher.find_terms(query_c));
+
+    spdlog::info("search {} parts", terms->lookups.size());
+
+    auto lookups = kj::heapArrayBuilder<
+      kj::Promise<std::optional<search::part_matches>>>(terms->lookups.size());
+
+    for (auto &l: terms->lookups) {
+      auto &path = l.first;
+      auto &part_terms = l.second;
+
+      lookups.add(workers->run(
+          [this, &path, &part_terms] () {
+            return searcher.find_part_matches(path, part_terms);
+          }).then(
+          [] (auto matches) {
+            return std::optional(std::move(matches));
+          },
+          [path] (auto exception) {
+            spdlog::warn("failed to search part {}: {}", path,
+                std::string(exception.getDescription()));
+
+            return std::optional<search::part_matches>();
+          }));
+    }
+
+    return kj::joinPromises(lookups.finish()).then(
+        [this, k, normalize, terms = kj::mv(terms)] (auto results) mutable {
+          std::vector<std::optional<search::part_matches>> parts;
+          for (auto &r: results) {
+            parts.push_back(std::move(r));
+          }
+
+          auto postings = searcher.merge_matches(*terms, parts);
+
+          std::vector<std::pair<std::string, double>> matches;
+
+          if (postings.empty()) {
+            return matches;
+          }
+
+          auto intersected = search::intersect_postings(postings, normalize,
+              searcher.info.url_max_len);
+
+          matches.assign(intersected.begin(), intersected.end());
+
+          auto cmp = [] (auto &a, auto &b) {
+              return a.second > b.second;
+            };
+
+          if (matches.size() > k) {
+            std::partial_sort(matches.begin(), matches.begin() + k, matches.end(), cmp);
+            matches.resize(k);
+          } else {
+            std::sort(matches.begin(), matches.end(), cmp);
+          }
+
+          return matches;
+        });
+  }
+
+  // Scatter the query to every shard and merge their top k. Shards
+  // that fail or do not answer within the timeout are left out so a
+  // slow shard gives partial results rather than a slow search.
+  kj::Promise<std::vector<std::pair<std::string, double>>>
+  findMatches(const std::string &query, size_t k)
+  {
+    if (!sharded()) {
+      return searchLocal(query, k, true);
+    }
+
+    if (shards.empty()) {
+      spdlog::warn("no search shards for {}", query);
+      return std::vector<std::pair<std::string, double>>();
+    }
+
+    auto timeout = settings.searcher.shard_timeout_ms * kj::MILLISECONDS;
+
+    auto requests = kj::heapArrayBuilder<
+      kj::Promise<std::optional<std::vector<std::pair<std::string, double>>>>>(shards.size());
+
+    for (auto &s: shards) {
+      auto request = s.searchShardRequest();
+
+      request.setQuery(query);
+      request.setK(k);
 
-    receiver = listenAddr->listen();
+      auto response = request.send().then(
+          [] (auto result) {
+            std::vector<std::pair<std::string, double>> matches;
 
-    tasks.add(server->listenHttp(*receiver));
+            for (auto r: result.getResults()) {
+              matches.emplace_back(r.getUrl(), r.getMatch());
+            }
+
+            return std::optional(matches);
+          });
+
+      requests.add(timer.timeoutAfter(timeout, kj::mv(response)).then(
+          [] (auto matches) {
+            return matches;
+          },
+          [] (auto exception) {
+            spdlog::warn("search shard failed: {}",
+                std::string(exception.getDescription()));
+
+            return std::optional<std::vector<std::pair<std::string, double>>>();
+          }));
+    }
+
+    return kj::joinPromises(requests.finish()).then(
+        [this, k, query] (auto responses) {
+          std::vector<std::pair<std::string, double>> matches;
+
+          size_t responded = 0;
+          for (auto &r: responses) {
+            if (r) {
+              responded++;
+              matches.insert(matches.end(), r->begin(), r->end());
+            }
+          }
+
+          if (responded < settings.searcher.shards) {
+            spdlog::warn("partial results for {} from {} / {} shards",
+                query, responded, settings.searcher.shards);
+          }
+
+          std::sort(matches.begin(), matches.end(),
+              [] (auto &a, auto &b) {
+                  return a.second > b.second;
+              });
+
+          if (matches.size() > k) {
+            matches.resize(k);
+          }
+
+          double sum_scores = 0;
+          for (auto &m: matches) {
+            sum_scores += m.second;
+          }
+
+          if (sum_scores > 0) {
+            for (auto &m: matches) {
+              m.second /= sum_scores;
+            }
+          }
+
+          return matches;
+        });
   }
 
   kj::Promise<void> search(SearchContext context) override {
     spdlog::info("got search request");
 
+    // A shard only has its run of the pages, its results on their
+    // own would be partial. Searches go to the front end.
+    if (!front_end && settings.searcher.shards > 1) {
+      return KJ_EXCEPTION(FAILED, "search shards only answer searchShard", shard);
+    }
+
     auto params = context.getParams();
 
     std::string query = params.getWord();
+    size_t k = params.getK();
+    size_t offset = params.getOffset();
+
+    if (k == 0) {
+      k = default_api_k;
+    }
+
+    return pageMatches(query, k, offset).then(
+        [context] (auto matches) mutable {
+          auto results = context.getResults();
+
+          auto urls = results.initResults(matches.size());
+          auto structured = results.initMatches(matches.size());
+
+          for (size_t i = 0; i < matches.size(); i++) {
+            urls.set(i, matches[i].url);
+
+            structured[i].setUrl(matches[i].url);
+            structured[i].setMatch(matches[i].match);
+            structured[i].setTitle(matches[i].title);
+            structured[i].setPath(matches[i].path);
+            structured[i].setRank(matches[i].rank);
+          }
+        });
+  }
+
+  // Resolve page info for a slice of matches, keeping their order.
+  // Pages the master has no info for are dropped.
+  kj::Promise<std::vector<search_match>>
+  lookupPages(std::vector<std::pair<std::string, double>> matches)
+  {
+    auto requests = kj::heapArrayBuilder<
+      kj::Promise<std::optional<search_match>>>(matches.size());
+
+    for (auto &page: matches) {
+      auto request = master.getPageInfoRequest();
+
+      request.setUrl(page.first);
+
+      requests.add(request.send().then(
+          [page] (auto result) {
+            std::string title = result.getTitle();
+            std::string path = result.getPath();
+
+            if (title == "" || path == "") {
+              return std::optional<search_match>();
+            }
+
+            return std::optional<search_match>(search_match(
+                  page.first, title, path,
+                  page.second, result.getScore()));
+          },
+          [page] (auto exception) {
+            spdlog::warn("error getting page info {}: {}", page.first,
+                std::string(exception.getDescription()));
+
+            return std::optional<search_match>();
+          }));
+    }
+
+    return kj::joinPromises(requests.finish()).then(
+        [] (auto responses) {
+          std::vector<search_match> results;
+
+          for (auto &r: responses) {
+            if (r) {
+              results.push_back(std::move(*r));
+            }
+          }
+
+          return results;
+        });
+  }
+
+  // A page of results. Only the top k + offset matches are selected
+  // and only the page itself has its info looked up.
+  kj::Promise<std::vector<search_match>>
+  pageMatches(const std::string &query, size_t k, size_t offset)
+  {
+    k = std::min(k, max_api_k);
+    offset = std::min(offset, max_api_offset);
+
+    return findMatches(query, k + offset).then(
+        [this, k, offset] (auto matches) {
+          if (matches.size() <= offset) {
+            return kj::Promise<std::vector<search_match>>(
+                std::vector<search_match>());
+          }
+
+          size_t end = std::min(offset + k, matches.size());
+
+          std::vector<std::pair<std::string, double>> page(
+              matches.begin() + offset, matches.begin() + end);
+
+          return lookupPages(std::move(page));
+        });
+  }
+
+  static size_t parse_size(kj::StringPtr s, size_t def) {
+    try {
+      return std::stoul(std::string(s));
+    } catch (const std::exception &e) {
+      return def;
+    }
+  }
+
+  kj::Promise<void> apiSearch(const kj::Url &url, Response& response)
+  {
+    std::string query;
+    size_t k = default_api_k;
+    size_t offset = 0;
 
-    return kj::READY_NOW;
+    for (auto &u: url.query) {
+      if (u.name == "q") {
+        query = u.value;
+      } else if (u.name == "k") {
+        k = parse_size(u.value, default_api_k);
+      } else if (u.name == "offset") {
+        offset = parse_size(u.value, 0);
+      }
+    }
+
+    if (query == "" || k == 0) {
+      return response.sendError(400, "Bad Request", *hTable);
+    }
+
+    return pageMatches(query, k, offset).then(
+        [this, &response, query, k, offset] (auto matches) {
+          json j = {
+            {"query", query},
+            {"k", k},
+            {"offset", offset},
+            {"results", json::array()},
+          };
+
+          for (auto &m: matches) {
+            j["results"].push_back({
+                {"url", m.url},
+                {"title", m.title},
+                {"path", m.path},
+                {"match", m.match},
+                {"rank", m.rank},
+              });
+          }
+
+          auto body = kj::str(j.dump());
+
+          kj::HttpHeaders respHeaders(*hTable);
+          respHeaders.set(hContentType, "application/json");
+
+          auto stream = response.send(200, "OK", respHeaders, body.size());
+          auto promise = stream->write(body.begin(), body.size());
+
+          return promise.attach(kj::mv(stream), kj::mv(body));
+        });
+  }
+
+  kj::Promise<void> searchShard(SearchShardContext context) override {
+    auto params = context.getParams();
+
+    std::string query = params.getQuery();
+    size_t k = params.getK();
+
+    spdlog::info("got search shard request for {} top {}", query, k);
+
+    return searchLocal(query, k, false).then(
+        [context] (auto matches) mutable {
+          auto results = context.getResults().initResults(matches.size());
+          for (size_t i = 0; i < matches.size(); i++) {
+            results[i].setUrl(matches[i].first);
+            results[i].setMatch(matches[i].second);
+          }
+        });
   }
 
   kj::Promise<void> request(
@@ -282,6 +687,10 @@ public:
 
     auto url = urlBase.parseRelative(urlStr);
 
+    if (url.path.size() == 2 && url.path[0] == "api" && url.path[1] == "search") {
+      return apiSearch(url, response);
+    }
+
     kj::StringPtr query;
 
     for (auto &u: url.query) {
@@ -302,6 +711,10 @@ public:
 
   search::searcher searcher;
 
+  // Looks up index parts for searcher, only when it holds some of
+  // the index. Declared after it so the threads stop first.
+  kj::Own<worker_pool> workers;
+
   Master::Client master;
 
   kj::Url urlBase;
@@ -316,6 +729,20 @@ public:
   kj::Own<kj::HttpHeaderTable> hTable;
   kj::Own<kj::HttpServer> server;
   kj::Own<kj::ConnectionReceiver> receiver;
+
+  // Sharding
+
+  bool front_end;
+  size_t shard;
+
+  std::vector<Searcher::Client> shards;
+
+  static constexpr size_t default_api_k = 10;
+  static constexpr size_t max_api_k = 100;
+  static constexpr size_t max_api_offset = 1000;
+
+  static constexpr size_t max_free_bufs = 16;
+  std::vector<std::string> free_bufs;
 };
 
 int main(int argc, char *argv[]) {
@@ -327,16 +754,31 @@ int main(int argc, char *argv[]) {
   spdlog::info("read config");
   config settings = read_config();
 
+  // With a shard index this runs as a search shard that only answers
+  // searchShard for its part of the index. Without one it runs the
+  // http front end.
+  bool front_end = argc < 2;
+  size_t shard = front_end ? 0 : std::stoul(argv[1]);
+
+  if (!front_end && shard >= settings.searcher.shards) {
+    spdlog::error("shard {} is out of range for {} shards", shard, settings.searcher.shards);
+    return 1;
+  }
+
   // two way vat
 
   kj::UnixEventPort::captureSignal(SIGINT);
   kj::UnixEventPort::captureSignal(SIGPIPE);
   auto ioContext = kj::setupAsyncIo();
 
-  auto listenAddrPromise = ioContext.provider->getNetwork().parseAddress(listenAddress, 8080);
+  kj::Own<kj::NetworkAddress> listenAddr;
 
-  auto listenAddr = listenAddrPromise.wait(ioContext.waitScope);
-  spdlog::info("listen addr {}", std::string(listenAddr->toString().cStr()));
+  if (front_end) {
+    auto listenAddrPromise = ioContext.provider->getNetwork().parseAddress(listenAddress, 8080);
+
+    listenAddr = listenAddrPromise.wait(ioContext.waitScope);
+    spdlog::info("listen addr {}", std::string(listenAddr->toString().cStr()));
+  }
 
   auto addrPromise = ioContext.provider->getNetwork().parseAddress(bindAddress)
   .then([](kj::Own<kj::NetworkAddress> addr) {
@@ -363,28 +805,34 @@ int main(int argc, char *argv[]) {
 
     Searcher::Client searcher = kj::heap<SearcherImpl>(ioContext,
         builder,
-        listenAddr,
+        listenAddr.get(),
         settings,
-        master);
+        master,
+        front_end,
+        shard);
 
     spdlog::info("client made");
 
-    spdlog::info("create request");
-    auto request = master.registerSearcherRequest();
-    request.setSearcher(searcher);
-
-    spdlog::info("send searcher register");
-
-    auto r = request.send().then(
-        [] (auto result) {
-          spdlog::info("searcher registered");
-        },
-        [] (auto exception) {
-          spdlog::warn("exception registering searcher : {}", std::string(exception.getDescription()));
-        });
+    // The front end of a sharded search is not a shard itself.
+    if (!front_end || settings.searcher.shards <= 1) {
+      spdlog::info("create request");
+      auto request = master.registerSearcherRequest();
+      request.setSearcher(searcher);
+      request.setShard(shard);
+
+      spdlog::info("send searcher register");
+
+      auto r = request.send().then(
+          [] (auto result) {
+            spdlog::info("searcher registered");
+          },
+          [] (auto exception) {
+            spdlog::warn("exception registering searcher : {}", std::string(exception.getDescription()));
+          });
 
-    spdlog::info("waiting for register");
-    r.wait(ioContext.waitScope);
+      spdlog::info("waiting for register");
+      r.wait(ioContext.waitScope);
+    }
 
     spdlog::info("waiting for sigint");
     ioContext.unixEventPort.onSignal(SIGINT).wait(ioContext.waitScope);
@@ -392,4 +840,3 @@ int main(int argc, char *argv[]) {
 
   return 0;
 }
-
@@ -9,6 +9,7 @@
 #include <sstream>
 #include <cstdint>
 #include <chrono>
+#include <optional>
 #include <assert.h>
 
 #include <sys/stat.h>
@@ -27,13 +28,7 @@ using nlohmann::json;
 
 namespace search {
 
-struct terms {
-  std::list<std::string> words;
-  std::list<std::string> pairs;
-  std::list<std::string> trines;
-};
-
-static terms split_terms(char *line)
+static query_terms split_terms(char *line)
 {
   const size_t buf_len = 512;
 
@@ -52,7 +47,7 @@ static terms split_terms(char *line)
   tokenizer::token_type token;
   tokenizer::tokenizer tok(line, strlen(line));
 
-  terms t;
+  query_terms t;
 
   do {
     token = tok.next(&tok_buffer);
@@ -102,32 +97,39 @@ static terms split_terms(char *line)
  * Trotman, A., X. Jia, M. Crane, Towards an Efficient and Effective Search Engine,
  * SIGIR 2012 Workshop on Open Source Information Retrieval, p. 40-47
  */
+// df is how many docs in the whole index have the term, postings
+// only has the ones in this shard.
 static std::vector<std::pair<std::string, double>>
 rank(
     std::vector<post> &postings,
-    std::vector<std::pair<std::string, uint32_t>> &pages,
-    double avgdl)
+    size_t df,
+    const searcher &s)
 {
   if (postings.empty()) {
     return {};
   }
 
+  auto &pages = s.info.pages;
+  double avgdl = s.info.average_page_length;
+
   std::vector<std::pair<std::string, double>> pairs_ranked;
 
   pairs_ranked.reserve(postings.size());
 
   // IDF = ln(N/df_t)
-  double wt = log(pages.size() / postings.size());
+  double wt = log(s.page_count / df);
   size_t p_i = 0;
   for (auto &p: postings) {
     spdlog::trace("have pair {} : {},{} ({})", p_i++, p.id, p.count, pages.size());
 
-    assert(p.id < pages.size());
+    size_t id = p.id - s.page_lo;
 
-    auto &page = pages.at(p.id);
+    assert(id < pages.size());
+
+    auto &page = pages.at(id);
     spdlog::trace("{} = {} : {}", p.id, page.first, page.second);
 
-    std::string &page_url = page.first;
+    const std::string &page_url = page.first;
     double docLength = page.second;
     double tf = p.count;
 
@@ -155,52 +157,229 @@ rank(
   return pairs_ranked;
 }
 
-void searcher::find_part_matches(
-    index_reader &part,
-    const std::string &term,
+// A shard only keeps its run of page ids. Postings are sorted by
+// id so with the parts' skips a shard only decodes around its own
+// docs. The page count and url length stay those of the whole
+// index so scores from every shard are comparable.
+void searcher::load(size_t s, size_t n)
+{
+  info.load();
+
+  shard = s;
+  shards = std::max(n, (size_t) 1);
+  page_count = info.pages.size();
+
+  if (shards == 1) {
+    return;
+  }
+
+  page_lo = page_count * shard / shards;
+  page_hi = page_count * (shard + 1) / shards;
+
+  info.pages.erase(info.pages.begin() + page_hi, info.pages.end());
+  info.pages.erase(info.pages.begin(), info.pages.begin() + page_lo);
+  info.pages.shrink_to_fit();
+
+  spdlog::info("shard {} / {} keeping pages {} to {} of {}",
+      shard, shards, page_lo, page_hi, page_count);
+}
+
+part_matches searcher::find_part_matches(
+    const std::string &path,
+    const std::vector<std::string> &terms)
+{
+  part_matches matches;
+
+  spdlog::info("load {}", path);
+  search::index_reader part(path, max_part_size);
+  part.load();
+
+  for (auto &term: terms) {
+    spdlog::debug("find term {} in {}", term, part.path);
+
+    size_t df = 0;
+    auto pairs = part.find(term, page_lo, page_hi, &df);
+
+    spdlog::debug("have pair {} with {} / {} docs", term, pairs.size(), df);
+    auto pairs_ranked = rank(pairs, df, *this);
+
+    spdlog::debug("have ranked {} with {} docs", term, pairs_ranked.size());
+    matches.postings.push_back(std::move(pairs_ranked));
+
+    if (part.has_positions()) {
+      auto positions = part.find_positions(term, page_lo, page_hi);
+      if (!positions.empty()) {
+        matches.positions.emplace(term, std::move(positions));
+      }
+    }
+  }
+
+  return matches;
+}
+
+// Docs that have the words in order next to each other and how
+// many times.
+static std::vector<post>
+phrase_posts(std::vector<std::vector<positional_post> *> &words)
+{
+  std::vector<post> posts;
+  std::vector<size_t> indexes(words.size(), 0);
+
+  for (auto &doc: *words[0]) {
+    bool in_all = true;
+
+    for (size_t i = 1; i < words.size(); i++) {
+      auto &w = *words[i];
+
+      while (indexes[i] < w.size() && w[indexes[i]].id < doc.id) {
+        indexes[i]++;
+      }
+
+      if (indexes[i] == w.size() || w[indexes[i]].id != doc.id) {
+        in_all = false;
+        break;
+      }
+    }
+
+    if (!in_all) {
+      continue;
+    }
+
+    uint32_t count = 0;
+
+    for (auto p: doc.positions) {
+      bool match = true;
+
+      for (size_t i = 1; i < words.size() && match; i++) {
+        auto &ps = (*words[i])[indexes[i]].positions;
+        match = std::binary_search(ps.begin(), ps.end(), p + i);
+      }
+
+      if (match) {
+        count++;
+      }
+    }
+
+    if (count > 0) {
+      posts.emplace_back(doc.id, std::min(count, (uint32_t) 255));
+    }
+  }
+
+  return posts;
+}
+
+// Docs that have the two words within window of each other, in
+// either order.
+static std::vector<post>
+near_posts(std::vector<positional_post> &a, std::vector<positional_post> &b,
+    uint32_t window)
+{
+  std::vector<post> posts;
+
+  size_t j = 0;
+
+  for (auto &doc: a) {
+    while (j < b.size() && b[j].id < doc.id) {
+      j++;
+    }
+
+    if (j == b.size()) {
+      break;
+    }
+
+    if (b[j].id != doc.id) {
+      continue;
+    }
+
+    auto &ps = b[j].positions;
+
+    uint32_t count = 0;
+
+    for (auto p: doc.positions) {
+      auto it = std::lower_bound(ps.begin(), ps.end(), p > window ? p - window : 0);
+
+      for (; it != ps.end() && *it <= p + window; it++) {
+        if (*it != p) {
+          count++;
+          break;
+        }
+      }
+    }
+
+    if (count > 0) {
+      posts.emplace_back(doc.id, std::min(count, (uint32_t) 255));
+    }
+  }
+
+  return posts;
+}
+
+// With positions the pairs and trines are matched from the words
+// themselves, along with words that are near each other.
+void searcher::find_phrase_matches(
+    std::list<std::string> &words,
+    std::map<std::string, std::vector<positional_post>> &positions,
     std::vector<std::vector<std::pair<std::string, double>>> &postings)
 {
-  spdlog::debug("find term {} in {}", term, part.path);
+  const uint32_t near_window = 8;
+
+  // Phrases are only matched within the shard so their df is a
+  // guess from how many the shard has.
+
+  std::vector<std::vector<positional_post> *> query;
 
-  auto pairs = part.find(term);
+  for (auto &w: words) {
+    auto it = positions.find(w);
+    query.push_back(it != positions.end() ? &it->second : nullptr);
+  }
 
-  spdlog::debug("have pair {} with {} docs", term, pairs.size());
-  auto pairs_ranked = rank(pairs, info.pages, info.average_page_length);
+  for (size_t i = 0; i + 1 < query.size(); i++) {
+    if (query[i] == nullptr || query[i+1] == nullptr) {
+      continue;
+    }
 
-  spdlog::debug("have ranked {} with {} docs", term, pairs_ranked.size());
-  postings.push_back(pairs_ranked);
+    std::vector<std::vector<positional_post> *> pair = {query[i], query[i+1]};
+
+    auto pair_posts = phrase_posts(pair);
+    spdlog::debug("have phrase {} with {} docs", i, pair_posts.size());
+    postings.push_back(rank(pair_posts, pair_posts.size() * shards, *this));
+
+    auto near = near_posts(*query[i], *query[i+1], near_window);
+    spdlog::debug("have near {} with {} docs", i, near.size());
+    postings.push_back(rank(near, near.size() * shards, *this));
+
+    if (i + 2 < query.size() && query[i+2] != nullptr) {
+      std::vector<std::vector<positional_post> *> trine = {query[i], query[i+1], query[i+2]};
+
+      auto trine_posts = phrase_posts(trine);
+      spdlog::debug("have phrase trine {} with {} docs", i, trine_posts.size());
+      postings.push_back(rank(trine_posts, trine_posts.size() * shards, *this));
+    }
+  }
 }
 
 void searcher::find_matches(
     std::map<uint32_t, std::string> &parts,
     std::list<std::string> &terms,
-    std::vector<std::vector<std::pair<std::string, double>>> &postings)
+    std::map<std::string, std::vector<std::string>> &lookups)
 {
-  spdlog::info("search");
   for (auto &term: terms) {
-    spdlog::info("search {}", term);
     uint32_t h = part_split(term, info.parts);
 
     spdlog::info("search {} -> part {}", term, h);
 
     auto it = parts.find(h);
     if (it != parts.end()) {
-      spdlog::info("have part {}", h);
-
-      auto &path = it->second;
-      spdlog::info("load {}", path);
-      search::index_reader part(path, max_part_size);
-      part.load();
-      find_part_matches(part, term, postings);
+      lookups[it->second].push_back(term);
     } else {
       spdlog::info("no part for {}", h);
     }
   }
 }
 
-std::vector<std::vector<std::pair<std::string, double>>> searcher::find_matches(char *line)
+query_terms searcher::find_terms(char *line)
 {
-  spdlog::info("find matches for {}", line);
+  spdlog::info("find terms for {}", line);
 
   auto terms = split_terms(line);
 
@@ -213,11 +392,46 @@ std::vector<std::vector<std::pair<std::string, double>>> searcher::find_matches(
   for (auto &t: terms.trines)
     spdlog::info("trine '{}'", t);
 
+  find_matches(info.word_parts, terms.words, terms.lookups);
+  find_matches(info.pair_parts, terms.pairs, terms.lookups);
+  find_matches(info.trine_parts, terms.trines, terms.lookups);
+
+  return terms;
+}
+
+// results has one entry per part in terms.lookups, in order, with
+// nothing for the parts that failed.
+std::vector<std::vector<std::pair<std::string, double>>> searcher::merge_matches(
+    query_terms &terms,
+    std::vector<std::optional<part_matches>> &results)
+{
   std::vector<std::vector<std::pair<std::string, double>>> postings;
+  std::map<std::string, std::vector<positional_post>> positions;
+
+  size_t failed = 0;
 
-  find_matches(info.word_parts, terms.words, postings);
-  find_matches(info.pair_parts, terms.pairs, postings);
-  find_matches(info.trine_parts, terms.trines, postings);
+  for (auto &r: results) {
+    if (!r) {
+      failed++;
+      continue;
+    }
+
+    for (auto &p: r->postings) {
+      postings.push_back(std::move(p));
+    }
+
+    positions.merge(r->positions);
+  }
+
+  // Missing some parts only loses some results, missing them all
+  // is an error and not an empty search.
+  if (failed > 0 && failed == results.size()) {
+    throw std::runtime_error(fmt::format("failed to search all {} parts", failed));
+  }
+
+  if (!positions.empty()) {
+    find_phrase_matches(terms.words, positions, postings);
+  }
 
   return postings;
 }
@@ -291,7 +505,8 @@ intersect_postings_strict(std::vector<std::vector<std::pair<std::string, double>
 }
 
 std::list<std::pair<std::string, double>>
-intersect_postings(std::vector<std::vector<std::pair<std::string, double>>> &postings)
+intersect_postings(std::vector<std::vector<std::pair<std::string, double>>> &postings,
+    bool normalize, size_t url_max_len)
 {
   spdlog::info("interset {}", postings.size());
 
@@ -309,7 +524,8 @@ intersect_postings(std::vector<std::vector<std::pair<std::string, double>>> &pos
     }
   }
 
-  size_t url_max_len = 0;
+  // Shards are given the index's url_max_len, otherwise it is the
+  // longest url that matched.
   std::list<std::pair<std::string, double>> result;
 
   while (true) {
@@ -389,6 +605,12 @@ intersect_postings(std::vector<std::vector<std::pair<std::string, double>>> &pos
     return {};
   }
 
+  // Shards leave the scores raw so the front end can
+  // normalize over the merged results.
+  if (!normalize) {
+    return result;
+  }
+
   for (auto &p: result) {
     p.second /= sum_scores;
 
@@ -0,0 +1,114 @@
+#ifndef SIMHASH_H
+#define SIMHASH_H
+
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+
+// A 64 bit SimHash. Each feature votes on every bit so pages that
+// share most of their features end up only a few bits apart.
+struct simhash {
+  int32_t v[64]{};
+  size_t count{0};
+
+  void add(uint64_t h) {
+    for (size_t i = 0; i < 64; i++) {
+      v[i] += (h >> i) & 1 ? 1 : -1;
+    }
+
+    count++;
+  }
+
+  uint64_t value() const {
+    uint64_t f = 0;
+    for (size_t i = 0; i < 64; i++) {
+      if (v[i] > 0) {
+        f |= (uint64_t) 1 << i;
+      }
+    }
+
+    return f;
+  }
+};
+
+static inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static inline int fingerprint_distance(uint64_t a, uint64_t b) {
+  return __builtin_popcountll(a ^ b);
+}
+
+// Finds fingerprints within max_distance bits of one added before.
+// Fingerprints are split into four 16 bit blocks, two that differ
+// in at most three bits have a block in common so only those need
+// comparing.
+template <typename T>
+struct fingerprint_index {
+  static constexpr int max_distance = 3;
+
+  std::unordered_multimap<uint32_t, std::pair<uint64_t, T>> blocks;
+
+  static uint32_t key(uint64_t f, uint32_t b) {
+    return (b << 16) | ((f >> (b * 16)) & 0xffff);
+  }
+
+  void add(uint64_t f, const T &v) {
+    for (uint32_t b = 0; b < 4; b++) {
+      blocks.emplace(key(f, b), std::make_pair(f, v));
+    }
+  }
+
+  void remove(uint64_t f, const T &v) {
+    for (uint32_t b = 0; b < 4; b++) {
+      auto range = blocks.equal_range(key(f, b));
+      for (auto it = range.first; it != range.second; it++) {
+        if (it->second.first == f && it->second.second == v) {
+          blocks.erase(it);
+          break;
+        }
+      }
+    }
+  }
+
+  // Anything close to f other than skip.
+  std::optional<T> find(uint64_t f, const std::optional<T> &skip = {}) const {
+    return find_if(f, skip, [] (const T &v, int d) { return true; });
+  }
+
+  // The first close to f other than skip that accept, given it and
+  // how many bits off it is, takes.
+  template <typename F>
+  std::optional<T> find_if(uint64_t f, const std::optional<T> &skip, F accept) const {
+    for (uint32_t b = 0; b < 4; b++) {
+      auto range = blocks.equal_range(key(f, b));
+      for (auto it = range.first; it != range.second; it++) {
+        if (it->second.second == skip) {
+          continue;
+        }
+
+        int d = fingerprint_distance(f, it->second.first);
+        if (d <= max_distance && accept(it->second.second, d)) {
+          return it->second.second;
+        }
+      }
+    }
+
+    return {};
+  }
+
+  size_t size() const {
+    return blocks.size() / 4;
+  }
+
+  void clear() {
+    blocks.clear();
+  }
+};
+
+#endif
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <cstdlib>
 #include <cstring>
@@ -20,40 +22,201 @@
 
 #include "util.h"
 #include "site.h"
+#include "site_view.h"
 
 #include "indexer.capnp.h"
 
+#include <capnp/serialize.h>
 #include <capnp/serialize-packed.h>
 
-void site_map::load_capnp()
+static size_t page_usage(const page &p)
+{
+  // The list node and the index entry pointing at it.
+  size_t u = sizeof(page) + 64 + 48;
+
+  u += p.url.size() + p.path.size() + p.title.size() + p.etag.size();
+
+  for (auto &a: p.aliases) {
+    u += sizeof(std::string) + a.size() + 48;
+  }
+
+  u += p.links.size() * sizeof(p.links[0]);
+
+  return u;
+}
+
+// Urls on this site's host have the scheme and host replaced by a
+// single marker byte.
+static const char url_marker_http = 1;
+static const char url_marker_https = 2;
+
+uint32_t site_map::add_url(const std::string &url)
+{
+  uint32_t id = url_offsets.size();
+
+  url_offsets.push_back(url_arena.size());
+
+  auto http = "http://" + host;
+  auto https = "https://" + host;
+
+  if (host != "" && util::has_prefix(url, https)) {
+    url_arena += url_marker_https;
+    url_arena.append(url, https.size(), std::string::npos);
+
+  } else if (host != "" && util::has_prefix(url, http)) {
+    url_arena += url_marker_http;
+    url_arena.append(url, http.size(), std::string::npos);
+
+  } else {
+    url_arena += url;
+  }
+
+  return id;
+}
+
+static std::string url_from_arena(const std::string &host,
+    const char *arena, size_t start, size_t end)
+{
+  if (start == end) {
+    return "";
+  }
+
+  char marker = arena[start];
+
+  if (marker == url_marker_https) {
+    return "https://" + host + std::string(arena + start + 1, end - start - 1);
+  } else if (marker == url_marker_http) {
+    return "http://" + host + std::string(arena + start + 1, end - start - 1);
+  } else {
+    return std::string(arena + start, end - start);
+  }
+}
+
+std::string site_map::get_url(uint32_t id) const
 {
-  int fd = open(path.c_str(), O_RDONLY);
+  size_t start = url_offsets.at(id);
+  size_t end = id + 1 < url_offsets.size() ? url_offsets[id + 1] : url_arena.size();
+
+  return url_from_arena(host, url_arena.data(), start, end);
+}
+
+site_view::site_view(const std::string &p)
+  : path(p)
+{
+  fd = open(path.c_str(), O_RDONLY);
   if (fd < 0) {
     spdlog::info("failed to open {}", path);
     return;
   }
 
+  struct stat s;
+  if (fstat(fd, &s) != 0 || s.st_size == 0) {
+    spdlog::info("failed to stat {} or empty", path);
+    return;
+  }
+
   capnp::ReaderOptions opts;
   opts.traversalLimitInWords = 128 * 1024 * 1024;
 
-  ::capnp::PackedFdMessageReader message(fd, opts);
+  uint8_t first;
+  if (pread(fd, &first, 1, 0) != 1) {
+    spdlog::info("failed to read {}", path);
+    return;
+  }
+
+  // An unpacked message starts with the segment count less one
+  // where packed starts with a tag byte that will have one of the
+  // high bits set for the first segment's size.
+  if (first < 0x10 && s.st_size % sizeof(capnp::word) == 0) {
+    map_len = s.st_size;
+    map = mmap(nullptr, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      map = nullptr;
+      spdlog::info("failed to map {}", path);
+      return;
+    }
+
+    message = std::make_unique<capnp::FlatArrayMessageReader>(
+        kj::arrayPtr((const capnp::word *) map, map_len / sizeof(capnp::word)),
+        opts);
+
+  } else {
+    message = std::make_unique<capnp::PackedFdMessageReader>(fd, opts);
+  }
+
+  site = message->getRoot<Site>();
+}
+
+site_view::~site_view()
+{
+  message.reset();
+
+  if (map != nullptr) {
+    munmap(map, map_len);
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+std::string site_view::get_url(uint32_t id)
+{
+  if (!site.hasUrlArena()) {
+    return site.getUrls()[id];
+  }
+
+  auto arena = site.getUrlArena();
+  auto offsets = site.getUrlOffsets();
 
-  Site::Reader reader = message.getRoot<Site>();
+  size_t start = offsets[id];
+  size_t end = id + 1 < offsets.size() ? offsets[id + 1] : arena.size();
+
+  return url_from_arena(site.getHost(), (const char *) arena.begin(), start, end);
+}
+
+void site_map::load_capnp()
+{
+  site_view view(path);
+  if (!view.ok()) {
+    return;
+  }
+
+  Site::Reader reader = view.site;
 
   host = reader.getHost();
 
-  for (auto url: reader.getUrls()) {
-    urls.emplace_back(url);   
+  if (reader.hasUrlArena()) {
+    auto arena = reader.getUrlArena();
+    url_arena.assign((const char *) arena.begin(), arena.size());
+
+    auto offsets = reader.getUrlOffsets();
+    url_offsets.reserve(offsets.size());
+    for (auto o: offsets) {
+      url_offsets.push_back(o);
+    }
+
+  } else {
+    // Sites saved before the arena.
+    for (auto url: reader.getUrls()) {
+      add_url(url);
+    }
   }
 
   for (auto page: reader.getPages()) {
-    pages.emplace_back(page.getUrl(), page.getPath());
+    auto it = pages.emplace(pages.end(), page.getUrl(), page.getPath());
 
-    auto &n = pages.back();
+    auto &n = *it;
 
     n.title = page.getTitle();
     n.last_scanned = page.getLastScanned();
 
+    n.archive_offset = page.getArchiveOffset();
+    n.archive_size = page.getArchiveSize();
+
+    n.etag = page.getEtag();
+    n.fingerprint = page.getFingerprint();
+
     for (auto a: page.getAliases()) {
       n.aliases.emplace_back(a);
     }
@@ -61,12 +224,24 @@ void site_map::load_capnp()
     for (auto l: page.getLinks()) {
       n.links.emplace_back(l.getUrl(), l.getCount());
     }
+
+    index_page(it);
   }
- 
-  close(fd);
-  
-  page_count = pages.size();
-  spdlog::debug("loaded {} : {} with {} urls", pages.size(), path, urls.size());
+
+  size_t u = url_arena.capacity() + url_offsets.capacity() * sizeof(uint32_t);
+
+  for (auto &p: pages) {
+    u += page_usage(p);
+  }
+
+  set_usage(u);
+
+  if (page_count != pages.size()) {
+    page_count = pages.size();
+    meta_change(path);
+  }
+
+  spdlog::debug("loaded {} : {} with {} urls", pages.size(), path, url_count());
 }
 
 void site_map::save() {
@@ -75,7 +250,10 @@ void site_map::save() {
     return;
   }
 
-  spdlog::info("saving  {} : {} with {} urls", pages.size(), path, urls.size());
+  spdlog::info("saving  {} : {} with {} urls", pages.size(), path, url_count());
+
+  bool meta_changed = page_count != pages.size();
+  std::string old_path = path;
 
   page_count = pages.size();
 
@@ -93,9 +271,11 @@ void site_map::save() {
   n.setPath(new_path);
   n.setHost(host);
 
-  auto n_urls = n.initUrls(urls.size());
-  for (size_t i = 0; i < urls.size(); i++) {
-    n_urls.set(i, urls[i]);
+  n.setUrlArena(kj::arrayPtr((const kj::byte *) url_arena.data(), url_arena.size()));
+
+  auto n_offsets = n.initUrlOffsets(url_offsets.size());
+  for (size_t i = 0; i < url_offsets.size(); i++) {
+    n_offsets.set(i, url_offsets[i]);
   }
 
   auto n_pages = n.initPages(pages.size());
@@ -105,8 +285,12 @@ void site_map::save() {
 
     n_page.setUrl(p.url);
     n_page.setPath(p.path);
+    n_page.setArchiveOffset(p.archive_offset);
+    n_page.setArchiveSize(p.archive_size);
     n_page.setTitle(p.title);
     n_page.setLastScanned(p.last_scanned);
+    n_page.setEtag(p.etag);
+    n_page.setFingerprint(p.fingerprint);
 
     auto aliases = n_page.initAliases(p.aliases.size());
     size_t i_a = 0;
@@ -123,30 +307,105 @@ void site_map::save() {
     }
   }
 
-  int fd = open(new_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0664);
+  // Written aside and renamed so anyone with the old file mapped,
+  // like an expansion on a worker, keeps a whole copy.
+  std::string tmp_path = new_path + ".tmp";
+
+  int fd = open(tmp_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0664);
   if (fd < 0) {
-    spdlog::info("failed to open {} for writing", new_path);
+    spdlog::info("failed to open {} for writing", tmp_path);
     throw std::runtime_error("failed to open site for writing");
   }
 
-  writePackedMessageToFd(fd, message);
+  // Unpacked so readers can map it, see site_view.
+  writeMessageToFd(fd, message);
   
   close(fd);
 
-  path = new_path;
+  if (rename(tmp_path.c_str(), new_path.c_str()) != 0) {
+    throw std::runtime_error(fmt::format("failed to rename {} to {}", tmp_path, new_path));
+  }
+
+  if (path != new_path) {
+    path = new_path;
+    meta_changed = true;
+  }
+
+  if (meta_changed) {
+    meta_change(old_path);
+  }
+}
+
+void site_map::meta_change(const std::string &old_path)
+{
+  if (tracker != nullptr && tracker->on_meta_change) {
+    tracker->on_meta_change(this, old_path);
+  }
+}
+
+void site_tracker::touch(site_map *s)
+{
+  if (s->tracked) {
+    sites.splice(sites.begin(), sites, s->tracked_it);
+  } else {
+    s->tracked = true;
+    s->tracked_it = sites.insert(sites.begin(), s);
+    total_usage += s->usage;
+  }
+}
+
+void site_tracker::flush()
+{
+  for (auto s: sites) {
+    s->tracked = false;
+    s->flush();
+  }
+
+  sites.clear();
+  total_usage = 0;
+}
+
+void site_tracker::evict()
+{
+  while (total_usage > max_usage && !sites.empty()) {
+    auto s = sites.back();
+    sites.pop_back();
+
+    total_usage -= s->usage;
+
+    s->tracked = false;
+    s->flush();
+
+    evictions++;
+  }
 }
 
 void site_map::reload() {
   loaded = true;
+  track();
 
-  urls.clear();
+  url_arena.clear();
+  url_offsets.clear();
   pages.clear();
+  url_index.clear();
 
   load_capnp();
 }
 
 void site_map::load() {
-  if (loaded) return;
+  if (tracker != nullptr) {
+    if (loaded) {
+      tracker->hits++;
+    } else {
+      tracker->misses++;
+    }
+  }
+
+  if (loaded) {
+    track();
+    return;
+  }
+
   reload();
 }
 
@@ -154,37 +413,92 @@ page* site_map::find_page(const std::string &url)
 {
   load();
 
-  for (auto &p: pages) {
-    if (p.url == url) {
-      return &p;
-    }
+  auto it = url_index.find(url);
+  if (it != url_index.end()) {
+    return &*it->second;
+  }
 
-    for (auto &a: p.aliases) {
-      if (a == url) {
-        return &p;
-      }
+  return NULL;
+}
+
+void site_map::index_page(std::list<page>::iterator p)
+{
+  url_index.emplace(p->url, p);
+
+  for (auto &a: p->aliases) {
+    url_index.emplace(a, p);
+  }
+}
+
+// Where p is in pages, from whichever of its urls it kept.
+std::list<page>::iterator site_map::page_it(page *p)
+{
+  auto it = url_index.find(p->url);
+  if (it != url_index.end() && &*it->second == p) {
+    return it->second;
+  }
+
+  for (auto &a: p->aliases) {
+    it = url_index.find(a);
+    if (it != url_index.end() && &*it->second == p) {
+      return it->second;
     }
   }
 
-  return NULL;
+  // Only if every url it has was kept by another page.
+  return std::find_if(pages.begin(), pages.end(),
+      [p] (const page &q) { return &q == p; });
 }
 
-page* site_map::find_page_by_path(const std::string &path)
+// Folds dup into p, dup's url and aliases find p from now on. dup
+// is freed.
+void site_map::make_alias(page *dup, page *p)
 {
-  for (auto &p: pages) {
-    if (p.path == path) {
-      return &p;
+  changed = true;
+  track();
+
+  set_usage(usage - page_usage(*dup) - page_usage(*p));
+
+  auto dup_it = page_it(dup);
+  auto p_it = page_it(p);
+
+  auto move_url = [this, dup, p, p_it] (const std::string &u) {
+    p->aliases.push_back(u);
+
+    auto it = url_index.find(u);
+    if (it != url_index.end() && &*it->second == dup) {
+      it->second = p_it;
     }
+  };
+
+  move_url(dup->url);
+  for (auto &a: dup->aliases) {
+    move_url(a);
   }
 
-  return NULL;
+  set_usage(usage + page_usage(*p));
+
+  if (dup_it != pages.end()) {
+    pages.erase(dup_it);
+    page_count--;
+    meta_change(path);
+  }
 }
 
 page* site_map::add_page(const std::string &url, const std::string &path)
 {
   changed = true;
+  track();
+
   page_count++;
-  return &pages.emplace_back(url, path);
+  meta_change(this->path);
+
+  auto it = pages.emplace(pages.end(), url, path);
+  index_page(it);
+
+  set_usage(usage + page_usage(*it));
+
+  return &*it;
 }
 
 
@@ -6,16 +6,34 @@
 #include <thread>
 #include <vector>
 #include <list>
+#include <unordered_map>
+#include <functional>
 
 struct page {
   std::string url;
+
+  // The archive segment holding the page, see archive.h. Older
+  // pages have a file of their own and no archive size.
   std::string path;
+  uint64_t archive_offset{0};
+  uint64_t archive_size{0};
+
   std::string title{"unknown"};
 
   time_t last_scanned{0};
 
+  // From the last fetch, sent back to ask for the page only if it
+  // changed.
+  std::string etag;
+
+  // SimHash of the text, see simhash.h. Pages close to another on
+  // the site become its aliases.
+  uint64_t fingerprint{0};
+
   std::vector<std::string> aliases;
-  std::vector<std::pair<size_t, size_t>> links;
+
+  // url id in the site's urls and the number of times linked.
+  std::vector<std::pair<uint32_t, uint32_t>> links;
 
   page() {}
 
@@ -30,18 +48,86 @@ struct page {
 void to_json(nlohmann::json &j, const page &s);
 void from_json(const nlohmann::json &j, page &s);
 
+struct site_map;
+
+// Keeps the site maps that have been loaded or changed, most
+// recently used first, so they can be flushed without going over
+// every site and evicted once they use more than max_usage.
+struct site_tracker {
+  std::list<site_map *> sites;
+
+  size_t max_usage;
+
+  size_t hits{0};
+  size_t misses{0};
+  size_t evictions{0};
+
+  // Called when a site's path or page count change, the parts of
+  // it that are kept outside the site file. Given the old path.
+  std::function<void(site_map *, const std::string &)> on_meta_change;
+
+  // Sum of the tracked sites' usage, kept up to date by the sites
+  // so evict does not need to go over them all.
+  size_t total_usage{0};
+
+  site_tracker(size_t max_usage = SIZE_MAX)
+    : max_usage(max_usage) {}
+
+  void touch(site_map *s);
+  void flush();
+
+  // Only call this when nothing is holding onto pages or sites that
+  // could be evicted.
+  void evict();
+
+  size_t usage() const {
+    return total_usage;
+  }
+};
+
 struct site_map {
   std::string path;
   std::string host;
 
   size_t page_count{0};
 
-  std::vector<std::string> urls;
+  // Linked urls packed one after the other, see add_url.
+  std::string url_arena;
+  std::vector<uint32_t> url_offsets;
+
   std::list<page> pages;
 
+  // Lookup into pages. The first page to have a url or alias
+  // keeps it. List iterators stay valid until their page is erased
+  // so pages can be dropped without a search.
+  std::unordered_map<std::string, std::list<page>::iterator> url_index;
+
   bool loaded{false};
   bool changed{false};
 
+  // Rough bytes used by the loaded pages and urls. Only change it
+  // with set_usage so the tracker's total follows.
+  size_t usage{0};
+
+  site_tracker *tracker{nullptr};
+  bool tracked{false};
+  std::list<site_map *>::iterator tracked_it;
+
+  void track() {
+    if (tracker != nullptr) {
+      tracker->touch(this);
+    }
+  }
+
+  void set_usage(size_t u) {
+    if (tracked) {
+      tracker->total_usage += u;
+      tracker->total_usage -= usage;
+    }
+
+    usage = u;
+  }
+
   void flush() {
     if (changed) {
       save();
@@ -51,8 +137,11 @@ struct site_map {
     if (loaded) {
       loaded = false;
       spdlog::debug("clear {}", path);
-      urls.clear();
+      std::string().swap(url_arena);
+      std::vector<uint32_t>().swap(url_offsets);
       pages.clear();
+      url_index.clear();
+      set_usage(0);
     }
   }
 
@@ -62,7 +151,31 @@ struct site_map {
   void load();
   void save();
 
-  site_map(site_map &&o) = default;
+  // The tracker holds onto the site by address so a tracked site
+  // hands its place over.
+  site_map(site_map &&o)
+    : path(std::move(o.path)),
+      host(std::move(o.host)),
+      page_count(o.page_count),
+      url_arena(std::move(o.url_arena)),
+      url_offsets(std::move(o.url_offsets)),
+      pages(std::move(o.pages)),
+      url_index(std::move(o.url_index)),
+      loaded(o.loaded),
+      changed(o.changed),
+      usage(o.usage),
+      tracker(o.tracker),
+      tracked(o.tracked),
+      tracked_it(o.tracked_it)
+  {
+    if (tracked) {
+      *tracked_it = this;
+      o.tracked = false;
+    }
+
+    o.usage = 0;
+  }
+
   site_map(site_map &o) = delete;
 
   site_map() {}
@@ -77,10 +190,31 @@ struct site_map {
       changed(true)
   {}
 
+  void set_tracker(site_tracker *t) {
+    tracker = t;
+    if (loaded || changed) {
+      track();
+    }
+  }
+
   page* find_page(const std::string &url);
-  page* find_page_by_path(const std::string &path);
 
   page* add_page(const std::string &url, const std::string &path);
+
+  size_t url_count() const {
+    return url_offsets.size();
+  }
+
+  uint32_t add_url(const std::string &url);
+  std::string get_url(uint32_t id) const;
+
+  void index_page(std::list<page>::iterator p);
+  std::list<page>::iterator page_it(page *p);
+
+  // Tells the tracker the path or page count changed.
+  void meta_change(const std::string &old_path);
+
+  void make_alias(page *dup, page *p);
 };
 
 #endif
@@ -0,0 +1,37 @@
+#ifndef SITE_VIEW_H
+#define SITE_VIEW_H
+
+#include <string>
+#include <memory>
+
+#include "indexer.capnp.h"
+
+#include <capnp/message.h>
+
+// Read only access to a saved site straight from the message
+// without copying it into a site_map. Unpacked files are mapped,
+// packed ones from before sites were saved unpacked are read in.
+struct site_view {
+  std::string path;
+
+  int fd{-1};
+  void *map{nullptr};
+  size_t map_len{0};
+
+  std::unique_ptr<capnp::MessageReader> message;
+  Site::Reader site;
+
+  site_view(const std::string &path);
+  ~site_view();
+
+  site_view(const site_view &o) = delete;
+  site_view(site_view &&o) = delete;
+
+  bool ok() {
+    return message != nullptr;
+  }
+
+  std::string get_url(uint32_t id);
+};
+
+#endif